@@ -0,0 +1,302 @@
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <extSorter.h>
+#include "recordGenerator.h"
+
+using namespace std;
+
+/**
+ * @brief The settings of a benchmark run, on top of the settings of the sorts.
+ */
+struct BenchConfig
+{
+    SortConfig sort;
+    size_t num_of_records;
+    uint64_t seed;
+    string dir;                   // Directory of the generated inputs and the sorted outputs
+    vector<string> distributions; // Key distributions to sort, one sort each
+    string generate;              // File to generate instead of running the benchmark, if not empty
+
+    BenchConfig() : num_of_records(1000000), seed(42), dir(".")
+    {
+        sort.key_size = 10;
+        distributions.assign(KEY_DISTRIBUTIONS, KEY_DISTRIBUTIONS + NUM_OF_KEY_DISTRIBUTIONS);
+    }
+};
+
+/**
+ * @brief What a sort reports back from the process it ran in.
+ */
+struct BenchResult
+{
+    int sorted; // Result of ExtSorter::Sort
+    double seconds;
+    SortStats stats;
+};
+
+/**
+ * @brief Prints the usage of the benchmark on standard error.
+ */
+void print_usage()
+{
+    cerr << "Usage: extsort-bench [options]\n"
+            "Sorts generated records of every key distribution and prints one JSON line per sort.\n"
+            "  --records N            Number of records per sort (1000000)\n"
+            "  --record-size R        Size of each record in bytes (100)\n"
+            "  --key-size K           Size of the key in bytes (10)\n"
+            "  --mem MB               Memory limit in MB (32)\n"
+            "  --dists a,b,...        Key distributions among random, sorted, reverse, few-unique, skewed-prefix (all)\n"
+            "  --seed S               Seed of the generator (42)\n"
+            "  --dir DIR              Directory of the input and output files (.)\n"
+            "  --descending           Sort in descending order\n"
+            "  --threads N, --io-threads N, --replacement-selection, --compress, --temp-dir DIR\n"
+            "                         Passed to the sorter, see the README\n"
+            "  --generate FILE        Only write the records of the first distribution to FILE\n";
+}
+
+/**
+ * @brief Parses the command line.
+ *
+ * @return True if the options are valid, otherwise false.
+ */
+bool parse_args(char **argv, BenchConfig &config)
+{
+    for (argv++; argv[0]; argv++)
+    {
+        string option = argv[0];
+        bool has_value = argv[1] != nullptr;
+        if (option == "--records" && has_value)
+        {
+            config.num_of_records = strtoull(*++argv, nullptr, 10);
+        }
+        else if (option == "--record-size" && has_value)
+        {
+            config.sort.record_size = atol(*++argv);
+        }
+        else if (option == "--key-size" && has_value)
+        {
+            config.sort.key_size = atol(*++argv);
+        }
+        else if (option == "--mem" && has_value)
+        {
+            config.sort.amt_of_mem = atoi(*++argv);
+        }
+        else if (option == "--seed" && has_value)
+        {
+            config.seed = strtoull(*++argv, nullptr, 10);
+        }
+        else if (option == "--dir" && has_value)
+        {
+            config.dir = *++argv;
+        }
+        else if (option == "--generate" && has_value)
+        {
+            config.generate = *++argv;
+        }
+        else if (option == "--dists" && has_value)
+        {
+            config.distributions.clear();
+            string list = *++argv;
+            for (size_t start = 0; start <= list.size();)
+            {
+                size_t end = min(list.find(',', start), list.size());
+                config.distributions.push_back(list.substr(start, end - start));
+                start = end + 1;
+            }
+        }
+        else if (option == "--descending")
+        {
+            config.sort.sorting_order = 0;
+        }
+        else if (option == "--threads" && has_value)
+        {
+            config.sort.num_of_threads = max(1, atoi(*++argv));
+        }
+        else if (option == "--io-threads" && has_value)
+        {
+            config.sort.num_of_io_threads = max(0, atoi(*++argv));
+        }
+        else if (option == "--replacement-selection")
+        {
+            config.sort.replacement_selection = true;
+        }
+        else if (option == "--compress")
+        {
+            config.sort.compress = true;
+        }
+        else if (option == "--temp-dir" && has_value)
+        {
+            config.sort.temp_dirs.push_back(*++argv);
+        }
+        else
+        {
+            cerr << "Unknown option: " << option << endl;
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < config.distributions.size(); i++)
+    {
+        if (!RecordGenerator::IsDistribution(config.distributions[i]))
+        {
+            cerr << "Unknown distribution: " << config.distributions[i] << endl;
+            return false;
+        }
+    }
+    return config.sort.record_size > 0 && config.sort.key_size > 0 && config.sort.key_size <= config.sort.record_size &&
+           config.sort.amt_of_mem > 0 && !config.distributions.empty();
+}
+
+/**
+ * @brief Checks that a file holds 'num_of_records' records in the sorting order.
+ *
+ * @return True if the file is sorted, otherwise false.
+ */
+bool check_sorted(const string &file_name, const SortConfig &config, size_t num_of_records)
+{
+    FILE *file = fopen(file_name.c_str(), "rb");
+    if (!file)
+    {
+        return false;
+    }
+    size_t rec_size = config.record_size;
+    size_t block_records = max<size_t>(1, (1 << 20) / rec_size);
+    vector<char> block(block_records * rec_size);
+    vector<char> previous(rec_size);
+    size_t count = 0;
+    bool sorted = true;
+    size_t n;
+    while (sorted && (n = fread(block.data(), rec_size, block_records, file)) > 0)
+    {
+        for (size_t k = 0; k < n && sorted; k++, count++)
+        {
+            const char *record = &block[k * rec_size];
+            if (count > 0)
+            {
+                int cmp = memcmp(previous.data(), record, config.key_size);
+                sorted = config.sorting_order == 1 ? cmp <= 0 : cmp >= 0;
+            }
+            memcpy(previous.data(), record, rec_size);
+        }
+    }
+    fclose(file);
+    return sorted && count == num_of_records;
+}
+
+/**
+ * @brief Sorts a file in a child process, so that its peak memory is measured on its own.
+ *
+ * @param result Receives what the sort reported.
+ * @param peak_rss_kb Receives the peak resident memory of the child in KB.
+ * @return True if the child ran and reported back, otherwise false.
+ */
+bool run_sort(const SortConfig &config, const string &in_file, const string &out_file, BenchResult &result, long &peak_rss_kb)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        // Keeps the error messages of the sorter out of the JSON lines
+        cout.rdbuf(cerr.rdbuf());
+        close(fds[0]);
+        BenchResult child_result;
+        ExtSorter sorter(config);
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        child_result.sorted = sorter.Sort(in_file, out_file);
+        child_result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        child_result.stats = sorter.GetStats();
+        bool written = write(fds[1], &child_result, sizeof(child_result)) == static_cast<ssize_t>(sizeof(child_result));
+        close(fds[1]);
+        _exit(written ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool received = read(fds[0], &result, sizeof(result)) == static_cast<ssize_t>(sizeof(result));
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return false;
+    }
+    peak_rss_kb = usage.ru_maxrss;
+    return received;
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig config;
+    if (argc < 1 || !parse_args(argv, config))
+    {
+        print_usage();
+        return 1;
+    }
+
+    if (!config.generate.empty())
+    {
+        RecordGenerator generator(config.sort.record_size, config.sort.key_size, config.num_of_records, config.distributions[0], config.seed);
+        if (!generator.WriteFile(config.generate))
+        {
+            cerr << "Cannot write " << config.generate << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    bool all_ok = true;
+    for (size_t i = 0; i < config.distributions.size(); i++)
+    {
+        const string &distribution = config.distributions[i];
+        string in_file = config.dir + "/bench-" + to_string(getpid()) + "-" + distribution + ".in";
+        string out_file = config.dir + "/bench-" + to_string(getpid()) + "-" + distribution + ".out";
+        RecordGenerator generator(config.sort.record_size, config.sort.key_size, config.num_of_records, distribution, config.seed);
+        if (!generator.WriteFile(in_file))
+        {
+            cerr << "Cannot write " << in_file << endl;
+            remove(in_file.c_str());
+            return 1;
+        }
+
+        BenchResult result;
+        long peak_rss_kb = 0;
+        bool ran = run_sort(config.sort, in_file, out_file, result, peak_rss_kb);
+        bool ok = ran && result.sorted == 1 && check_sorted(out_file, config.sort, config.num_of_records);
+        remove(in_file.c_str());
+        remove(out_file.c_str());
+        all_ok = all_ok && ok;
+        if (!ran)
+        {
+            printf("{\"distribution\":\"%s\",\"ok\":false}\n", distribution.c_str());
+            continue;
+        }
+
+        double mb = static_cast<double>(config.num_of_records) * config.sort.record_size / (1024.0 * 1024.0);
+        printf("{\"distribution\":\"%s\",\"records\":%zu,\"record_size\":%ld,\"key_size\":%ld,\"mem_mb\":%d,"
+               "\"seconds\":%.3f,\"pass0_seconds\":%.3f,\"merge_seconds\":%.3f,\"records_per_s\":%.0f,\"mb_per_s\":%.1f,"
+               "\"runs\":%zu,\"merge_passes\":%zu,\"peak_rss_kb\":%ld,\"ok\":%s}\n",
+               distribution.c_str(), config.num_of_records, config.sort.record_size, config.sort.key_size, config.sort.amt_of_mem,
+               result.seconds, result.stats.pass0_seconds, result.stats.merge_seconds,
+               result.seconds > 0 ? config.num_of_records / result.seconds : 0.0, result.seconds > 0 ? mb / result.seconds : 0.0,
+               result.stats.num_of_runs, result.stats.num_of_passes, peak_rss_kb, ok ? "true" : "false");
+        fflush(stdout);
+    }
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+#ifndef RECORDGENERATOR_H
+#define RECORDGENERATOR_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * @brief A small pseudo-random generator (splitmix64) whose sequence is the same on every platform.
+ */
+class SplitMix64
+{
+    uint64_t m_state;
+
+public:
+    explicit SplitMix64(uint64_t seed) : m_state(seed) {}
+
+    uint64_t next()
+    {
+        uint64_t z = (m_state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    /**
+     * @brief Fills 'n' bytes with random data.
+     */
+    void fill(char *p, size_t n)
+    {
+        while (n > 0)
+        {
+            uint64_t v = next();
+            size_t k = min(n, sizeof(v));
+            memcpy(p, &v, k);
+            p += k;
+            n -= k;
+        }
+    }
+};
+
+// Key distributions of the generator
+const char *const KEY_DISTRIBUTIONS[] = {"random", "sorted", "reverse", "few-unique", "skewed-prefix"};
+const size_t NUM_OF_KEY_DISTRIBUTIONS = sizeof(KEY_DISTRIBUTIONS) / sizeof(KEY_DISTRIBUTIONS[0]);
+
+// Number of distinct keys of the "few-unique" distribution
+const size_t FEW_UNIQUE_KEYS = 16;
+
+// Number of shared prefixes of the "skewed-prefix" distribution
+const size_t SKEWED_PREFIXES = 8;
+
+/**
+ * @brief Generates records of one key distribution, the same records for the same seed.
+ *
+ * - random: uniformly random keys.
+ * - sorted / reverse: keys counting up or down, stored big-endian at the end of the key.
+ * - few-unique: keys drawn from FEW_UNIQUE_KEYS random keys.
+ * - skewed-prefix: the first half of every key is one of SKEWED_PREFIXES random prefixes, the first one taking
+ *   half of the records, the next one a quarter and so on, like the tenant ids and timestamps leading real keys.
+ *   The rest of the key is random.
+ *
+ * The payload after the key is random.
+ */
+class RecordGenerator
+{
+    size_t m_rec_size;
+    size_t m_key_size;
+    size_t m_num_of_records;
+    string m_distribution;
+    SplitMix64 m_random;
+    size_t m_next;
+    vector<char> m_keys; // Keys or prefixes drawn from, back to back
+
+    /**
+     * @brief Stores 'value' big-endian in the last bytes of the key, zeroing the bytes before it.
+     */
+    void SetCounter(char *key, uint64_t value) const
+    {
+        memset(key, 0, m_key_size);
+        for (size_t i = 0; i < m_key_size && i < sizeof(value); i++)
+        {
+            key[m_key_size - 1 - i] = static_cast<char>(value >> (8 * i));
+        }
+    }
+
+public:
+    RecordGenerator(size_t rec_size, size_t key_size, size_t num_of_records, const string &distribution, uint64_t seed)
+        : m_rec_size(rec_size), m_key_size(min(key_size, rec_size)), m_num_of_records(num_of_records),
+          m_distribution(distribution), m_random(seed), m_next(0)
+    {
+        if (m_distribution == "few-unique")
+        {
+            m_keys.resize(FEW_UNIQUE_KEYS * m_key_size);
+        }
+        else if (m_distribution == "skewed-prefix")
+        {
+            m_keys.resize(SKEWED_PREFIXES * (m_key_size / 2));
+        }
+        m_random.fill(m_keys.data(), m_keys.size());
+    }
+
+    /**
+     * @brief Checks if a distribution name is known.
+     */
+    static bool IsDistribution(const string &distribution)
+    {
+        return find(KEY_DISTRIBUTIONS, KEY_DISTRIBUTIONS + NUM_OF_KEY_DISTRIBUTIONS, distribution) != KEY_DISTRIBUTIONS + NUM_OF_KEY_DISTRIBUTIONS;
+    }
+
+    /**
+     * @brief Writes the next record.
+     *
+     * @param record A buffer of the record size.
+     */
+    void Next(char *record)
+    {
+        m_random.fill(record, m_rec_size);
+        if (m_distribution == "sorted")
+        {
+            SetCounter(record, m_next);
+        }
+        else if (m_distribution == "reverse")
+        {
+            SetCounter(record, m_num_of_records - 1 - m_next);
+        }
+        else if (m_keys.empty())
+        {
+            // Keys too short to hold a shared key or prefix stay random
+        }
+        else if (m_distribution == "few-unique")
+        {
+            memcpy(record, m_keys.data() + m_random.next() % FEW_UNIQUE_KEYS * m_key_size, m_key_size);
+        }
+        else if (m_distribution == "skewed-prefix")
+        {
+            // Each prefix takes half of the records left by the ones before it
+            uint64_t bits = m_random.next();
+            size_t prefix = 0;
+            while (prefix < SKEWED_PREFIXES - 1 && (bits >> prefix & 1))
+            {
+                prefix++;
+            }
+            size_t prefix_size = m_key_size / 2;
+            memcpy(record, m_keys.data() + prefix * prefix_size, prefix_size);
+        }
+        m_next++;
+    }
+
+    /**
+     * @brief Writes all records to a file in large blocks.
+     *
+     * @param file_name The file to create.
+     * @return True if the file was written, otherwise false.
+     */
+    bool WriteFile(const string &file_name)
+    {
+        FILE *file = fopen(file_name.c_str(), "wb");
+        if (!file)
+        {
+            return false;
+        }
+        size_t block_records = max<size_t>(1, (1 << 20) / m_rec_size);
+        vector<char> block(block_records * m_rec_size);
+        bool ok = true;
+        while (ok && m_next < m_num_of_records)
+        {
+            size_t n = min(block_records, m_num_of_records - m_next);
+            for (size_t k = 0; k < n; k++)
+            {
+                Next(&block[k * m_rec_size]);
+            }
+            ok = fwrite(block.data(), m_rec_size, n, file) == n;
+        }
+        return fclose(file) == 0 && ok;
+    }
+};
+
+#endif
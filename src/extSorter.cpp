@@ -0,0 +1,1612 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <record.h>
+#include <arenaSort.h>
+#include <extSorter.h>
+
+using namespace std;
+
+// The record shape of the current thread, see RecordShape
+thread_local long KEY_SIZE;
+thread_local long SIZE_OF_REC;
+thread_local KeyCompareFn KEY_COMPARE;
+
+/**
+ * @brief Calculates the number of blocks required for processing entities with given buffers.
+ *
+ * @param num_of_entities Total number of entities to process.
+ * @param num_of_buffers Number of available buffers.
+ * @return Number of blocks needed.
+ */
+size_t get_num_blocks(long num_of_entities, size_t num_of_buffers)
+{
+    double n = static_cast<double>(num_of_entities) / num_of_buffers;
+    return static_cast<size_t>(ceil(n));
+}
+
+/**
+ * @brief Calculates the number of runs that can be merged at once within the memory budget.
+ *
+ * Every run being merged, and the output, needs its own I/O block of at least MERGE_BLOCK_SIZE bytes,
+ * two of them when the I/O is asynchronous, so that the disk only sees large sequential reads and writes.
+ * Compressed runs also need a buffer for the compressed frame of each stream.
+ *
+ * @param amt_of_mem The amount of memory available for merging in MB.
+ * @param async_io Whether the merges prefetch and write behind their blocks.
+ * @param compressed Whether the runs are compressed.
+ * @return The merge fan-in, at least 2.
+ */
+size_t get_merge_fan_in(int amt_of_mem, bool async_io, bool compressed)
+{
+    size_t mem_in_bytes = static_cast<size_t>(amt_of_mem) * 1024 * 1024;
+    size_t block_size = max<size_t>(MERGE_BLOCK_SIZE, SIZE_OF_REC) * (async_io ? 2 : 1);
+    if (compressed)
+    {
+        block_size += FRAME_HEADER_SIZE + max<size_t>(COMPRESSED_FRAME_SIZE, SIZE_OF_REC);
+    }
+    size_t num_of_streams = mem_in_bytes / block_size;
+    return max<size_t>(2, num_of_streams > 0 ? num_of_streams - 1 : 0);
+}
+
+/**
+ * @brief Calculates the number of passes needed for external merge sort.
+ *
+ * @param num_of_runs Number of sorted runs produced by pass 0.
+ * @param fan_in Number of runs merged at once.
+ * @return Number of passes needed.
+ */
+int get_num_passes(size_t num_of_runs, size_t fan_in)
+{
+    int num_of_passes = 0;
+    for (size_t n = 1; n < num_of_runs; n *= fan_in)
+    {
+        num_of_passes++;
+    }
+    return num_of_passes;
+}
+
+/**
+ * @brief Plans the next intermediate merge pass.
+ *
+ * The pass merges just enough of the smallest runs for the remaining runs to be an exact power of the fan-in,
+ * so that every later pass, and the final one in particular, merges full groups of 'fan_in' runs.
+ * The first group holds the leftover runs that do not fill a whole group. Runs that are not merged are left in
+ * 'runs' and carried over to the next pass as they are, without being rewritten.
+ * Runs that must stay in the order of the input, for their records with equal keys to be reduced in that order,
+ * are grouped from the front instead of by size, and the merged runs go back in front of the runs left.
+ *
+ * @param runs The runs to merge, from which the runs of the groups are removed.
+ * @param fan_in Number of runs merged at once, more than the number of runs would need a single pass.
+ * @param keep_order Whether the runs are kept in their order.
+ * @return The groups of runs to merge, each becoming one run.
+ */
+vector<vector<RunSegment>> plan_merge_pass(vector<RunSegment> &runs, size_t fan_in, bool keep_order)
+{
+    // Number of runs left for the final pass of a sort with the fewest passes
+    size_t num_of_final_runs = 1;
+    while (num_of_final_runs * fan_in < runs.size())
+    {
+        num_of_final_runs *= fan_in;
+    }
+
+    // Merging a group of n runs removes n - 1 runs
+    size_t num_of_runs_to_remove = runs.size() - num_of_final_runs;
+    size_t num_of_groups = get_num_blocks(num_of_runs_to_remove, fan_in - 1);
+    size_t first_group_size = num_of_runs_to_remove - (num_of_groups - 1) * (fan_in - 1) + 1;
+
+    // The smallest runs are merged first, since the runs merged now are read again by every later pass
+    if (!keep_order)
+    {
+        stable_sort(runs.begin(), runs.end(), [](const RunSegment &a, const RunSegment &b)
+                    { return a.end - a.begin < b.end - b.begin; });
+    }
+
+    vector<vector<RunSegment>> groups(num_of_groups);
+    size_t next = 0;
+    for (size_t i = 0; i < num_of_groups; i++)
+    {
+        size_t group_size = i == 0 ? first_group_size : fan_in;
+        groups[i].assign(runs.begin() + next, runs.begin() + next + group_size);
+        next += group_size;
+    }
+    runs.erase(runs.begin(), runs.begin() + next);
+    return groups;
+}
+
+// Fewest line entries worth sorting on a thread of their own
+const size_t LINE_SORT_MIN_PART = 64 * 1024;
+
+/**
+ * @brief Sorts the index of the lines of a run on a thread pool.
+ *
+ * The entries are split into one part per thread, each sorted on its own, and the sorted parts are merged
+ * pairwise, the merges of a round running concurrently.
+ *
+ * @param entries The entries of the lines.
+ * @param precedes The order of the entries.
+ * @param pool The thread pool sorting the parts.
+ */
+void sort_line_entries(vector<LineEntry> &entries, LineEntryPrecedes precedes, ThreadPool &pool)
+{
+    size_t num_of_parts = min(pool.size(), max<size_t>(1, entries.size() / LINE_SORT_MIN_PART));
+    if (num_of_parts == 1)
+    {
+        sort(entries.begin(), entries.end(), precedes);
+        return;
+    }
+
+    vector<vector<LineEntry>::iterator> bounds(num_of_parts + 1);
+    for (size_t i = 0; i <= num_of_parts; i++)
+    {
+        bounds[i] = entries.begin() + entries.size() * i / num_of_parts;
+    }
+    for (size_t i = 0; i < num_of_parts; i++)
+    {
+        pool.submit([&bounds, precedes, i]()
+                    { sort(bounds[i], bounds[i + 1], precedes); });
+    }
+    pool.wait();
+    for (size_t width = 1; width < num_of_parts; width *= 2)
+    {
+        for (size_t i = 0; i + width < num_of_parts; i += 2 * width)
+        {
+            size_t end = min(i + 2 * width, num_of_parts);
+            pool.submit([&bounds, precedes, i, width, end]()
+                        { inplace_merge(bounds[i], bounds[i + width], bounds[end], precedes); });
+        }
+        pool.wait();
+    }
+}
+
+/**
+ * @brief Merges runs of lines into one.
+ *
+ * @param runs The runs to merge, whose files index 'files'.
+ * @param files The open run files.
+ * @param writer The writer of the merged lines, which is flushed.
+ * @param block_size The size of the block of each reader in bytes.
+ * @param key_size The size of the keys.
+ * @param sorting_order The sorting order (1 for ascending, 0 for descending).
+ * @param limit The number of lines after which the merge stops.
+ * @return True if every line was read and written, otherwise false.
+ */
+bool merge_line_runs(const vector<RunSegment> &runs, const vector<unique_ptr<RunFile>> &files, LineWriter &writer, size_t block_size,
+                     long key_size, int sorting_order, size_t limit)
+{
+    vector<LineReader> readers;
+    readers.reserve(runs.size());
+    for (size_t k = 0; k < runs.size(); k++)
+    {
+        readers.push_back(LineReader(files[runs[k].file]->fd(), runs[k].begin, runs[k].end, block_size));
+    }
+    LineReaderPrecedes precedes = {&readers, key_size, sorting_order};
+    LoserTree<LineReaderPrecedes> tree(readers.size(), precedes);
+    for (size_t n = 0; n < limit && !readers.empty() && !readers[tree.winner()].empty(); n++)
+    {
+        LineReader &reader = readers[tree.winner()];
+        writer.write(reader.data(), reader.length());
+        reader.advance();
+        tree.replay();
+    }
+    writer.flush();
+    for (size_t i = 0; i < readers.size(); i++)
+    {
+        if (readers[i].failed())
+        {
+            return false;
+        }
+    }
+    return !writer.failed();
+}
+
+/**
+ * @brief Cuts a sorted output file after its records, which reduced or limited sorts write fewer of than they reserved.
+ *
+ * @param file_name The output file.
+ * @param num_of_records The number of records written.
+ * @return True if the file was cut, otherwise false.
+ */
+bool truncate_output(const string &file_name, size_t num_of_records)
+{
+    return truncate(file_name.c_str(), static_cast<off_t>(num_of_records * SIZE_OF_REC)) == 0;
+}
+
+/**
+ * @brief Constructs a sorter with its own thread pools.
+ *
+ * @param config The settings of the sort.
+ */
+ExtSorter::ExtSorter(const SortConfig &config)
+    : m_config(config),
+      m_shape(RecordShape::Make(config.record_size, config.key_size)),
+      m_pool(config.num_of_threads > 0 ? config.num_of_threads : max(1u, thread::hardware_concurrency())),
+      m_io_pool(config.num_of_io_threads > 0 ? new ThreadPool(config.num_of_io_threads) : nullptr),
+      m_num_of_offered(0), m_first_spill_file(0), m_num_of_spilled(0), m_next(0), m_finished(false), m_failed(false)
+{
+    // Sorters of the same process, and of other processes, never share run files
+    static atomic<unsigned> num_of_sorters(0);
+    m_job_name = m_config.temp_prefix + "extsort-" + to_string(getpid()) + "-" + to_string(num_of_sorters++);
+
+    // Lines are sorted on their leading bytes and never reduced
+    if (m_config.variable_length && (!m_config.key_spec.empty() || !m_config.unique.empty() || !m_config.combine.empty()))
+    {
+        FileSorter<RecordView>::perror(-10);
+        m_failed = true;
+        return;
+    }
+
+    // The records sorted carry their normalized key in front of them
+    if (!m_config.key_spec.empty())
+    {
+        if (!KeySpec::Parse(m_config.key_spec, m_config.record_size, m_key))
+        {
+            FileSorter<RecordView>::perror(-7);
+            m_failed = true;
+            return;
+        }
+        m_shape = RecordShape::Make(m_key.size() + m_config.record_size, m_key.size());
+        m_keyed.resize(m_shape.rec_size);
+    }
+
+    // Combined fields are placed in the records sorted, behind their normalized key
+    if (!m_config.unique.empty() || !m_config.combine.empty())
+    {
+        if (!RecordReducer::Parse(m_config.unique, m_config.combine, m_config.record_size, m_config.key_size, m_key, m_key.size(),
+                                  m_reducer))
+        {
+            FileSorter<RecordView>::perror(-8);
+            m_failed = true;
+        }
+    }
+}
+
+/**
+ * @brief Destructs the sorter, removing its temporary run files.
+ */
+ExtSorter::~ExtSorter()
+{
+    m_merger.reset();
+    m_pull_files.clear();
+    m_spills.clear();
+    m_runs.clear();
+    RemoveUnusedRunFiles();
+    if (!m_trace.empty() && !m_trace.Write(m_config.trace_file, m_config.trace_format))
+    {
+        clog << "Cannot write the trace file " << m_config.trace_file << endl;
+    }
+}
+
+/**
+ * @brief Names new temporary run files and registers them.
+ *
+ * The files take turns over the temporary directories by their index, so files created together land on
+ * different directories, and so do the files of successive passes.
+ *
+ * @param num_of_files The number of files to name.
+ * @return The index of the first new file in the run files.
+ */
+size_t ExtSorter::AddRunFiles(size_t num_of_files)
+{
+    size_t first_file = m_run_file_names.size();
+    for (size_t file = first_file; file < first_file + num_of_files; file++)
+    {
+        string dir;
+        if (!m_config.temp_dirs.empty())
+        {
+            dir = m_config.temp_dirs[file % m_config.temp_dirs.size()];
+            if (!dir.empty() && dir[dir.size() - 1] != '/')
+            {
+                dir += '/';
+            }
+        }
+        m_run_file_names.push_back(dir + m_job_name + "-run" + to_string(file) + ".dat");
+    }
+    return first_file;
+}
+
+/**
+ * @brief Returns the number of run files a pass writing 'num_of_runs' runs spreads them over.
+ */
+size_t ExtSorter::GetNumStripes(size_t num_of_runs)
+{
+    return max<size_t>(1, min(num_of_runs, m_config.temp_dirs.size()));
+}
+
+/**
+ * @brief Chooses between mapped and streamed I/O for files of the given size and the memory budget.
+ *
+ * @param file_size The size of the data to sort in bytes.
+ * @return True if the files should be mapped, otherwise false.
+ */
+bool ExtSorter::UseMmap(size_t file_size)
+{
+    if (m_config.io_mode == "auto")
+    {
+        return should_mmap(file_size, static_cast<size_t>(m_config.amt_of_mem) * 1024 * 1024);
+    }
+    return m_config.io_mode == "mmap";
+}
+
+/**
+ * @brief Gets the codec counters given to the temporary run files.
+ *
+ * @return The counters of the compression, or null if the run files are not compressed.
+ */
+CodecStats *ExtSorter::GetRunCodec()
+{
+    return m_config.compress ? &m_codec_stats : nullptr;
+}
+
+/**
+ * @brief Gets the counters given to the readers, writers and sorters of the phase running.
+ *
+ * @return The counters, or null if the sort is not traced, so that nothing is counted.
+ */
+PhaseCounters *ExtSorter::GetCounters()
+{
+    return m_config.trace_file.empty() ? nullptr : &m_counters;
+}
+
+/**
+ * @brief Gets the reduction given to the sorts and merges.
+ *
+ * @return The reduction, or null if every record is kept.
+ */
+const RecordReducer *ExtSorter::GetReducer()
+{
+    return m_reducer.empty() ? nullptr : &m_reducer;
+}
+
+/**
+ * @brief Checks if the sorts write fewer records than they read, reducing equal keys or stopping at the limit.
+ *
+ * @return True if the output files must be cut after the records written, otherwise false.
+ */
+bool ExtSorter::CutsOutput()
+{
+    return !m_reducer.empty() || m_config.limit > 0;
+}
+
+/**
+ * @brief Records a phase that ends now in the trace, with the counters of the phase and the peak memory so far.
+ *
+ * The counters are cleared for the next phase. Nothing is done when the sort is not traced.
+ *
+ * @param name The name of the phase.
+ * @param start When the phase started.
+ * @param args The numbers describing the phase.
+ */
+void ExtSorter::TracePhase(const string &name, chrono::steady_clock::time_point start, vector<pair<string, double>> args)
+{
+    if (m_config.trace_file.empty())
+    {
+        return;
+    }
+    args.push_back(make_pair("read_s", m_counters.read_ns / 1e9));
+    args.push_back(make_pair("write_s", m_counters.write_ns / 1e9));
+    args.push_back(make_pair("sort_s", m_counters.sort_ns / 1e9));
+    args.push_back(make_pair("comparisons", static_cast<double>(m_counters.comparisons)));
+    args.push_back(make_pair("peak_rss_kb", static_cast<double>(peak_rss_kb())));
+    m_trace.Add(name, start, args);
+    m_counters.reset();
+}
+
+/**
+ * @brief Reports the space saved by compressing the run files and the time it took on standard error.
+ */
+void ExtSorter::ReportCompression()
+{
+    if (!m_config.compress || m_codec_stats.raw_bytes == 0)
+    {
+        return;
+    }
+    double raw_mb = m_codec_stats.raw_bytes / (1024.0 * 1024.0);
+    double compressed_mb = m_codec_stats.compressed_bytes / (1024.0 * 1024.0);
+    clog << fixed << setprecision(2)
+         << "Compression: " << raw_mb << " MB -> " << compressed_mb << " MB (" << raw_mb / compressed_mb << "x), "
+         << "compress " << m_codec_stats.compress_ns / 1e9 << " s, decompress " << m_codec_stats.decompress_ns / 1e9 << " s"
+         << defaultfloat << endl;
+}
+
+/**
+ * @brief Writes the first 'limit' records of a file in sorted order to another file, in a single pass over the input.
+ *
+ * The records kept fit in memory, so the input is streamed once past a bounded heap (see FileSorter::TopK),
+ * and nothing is written to temporary files.
+ *
+ * @param in_file The input file containing the unsorted records.
+ * @param out_file The output file receiving the first records.
+ * @param use_mmap Whether to read and write the files through memory mappings.
+ * @return 1 if the records were written, -1 otherwise.
+ */
+int ExtSorter::SelectFirst(const string &in_file, const string &out_file, bool use_mmap)
+{
+    string in_file_name = in_file;
+    string out_file_name = out_file;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    long num_of_records;
+    {
+        FileSorter<RecordView> sorter(in_file_name, out_file_name, m_config.amt_of_mem, m_config.sorting_order, m_config.text_mode, use_mmap);
+        sorter.SetIOPool(m_io_pool.get());
+        sorter.SetCounters(GetCounters());
+        num_of_records = sorter.GetNumRecords();
+        if (num_of_records >= 0 && sorter.TopK(m_config.limit) != 1)
+        {
+            m_failed = true;
+        }
+    }
+    if (num_of_records < 0)
+    {
+        remove(out_file.c_str());
+        return -1;
+    }
+
+    size_t num_of_written = min<size_t>(num_of_records, m_config.limit);
+    m_stats.num_of_records = num_of_records;
+    m_stats.num_of_runs = min<size_t>(1, num_of_written);
+    m_stats.pass0_seconds += elapsed_ns(start) / 1e9;
+    TracePhase("top_k", start,
+               {make_pair("limit", static_cast<double>(m_config.limit)), make_pair("records", static_cast<double>(num_of_records)),
+                make_pair("bytes_read", static_cast<double>(num_of_records) * SIZE_OF_REC),
+                make_pair("bytes_written", static_cast<double>(num_of_written) * SIZE_OF_REC)});
+    if (!m_failed && !truncate_output(out_file, num_of_written))
+    {
+        FileSorter<RecordView>::perror(-2);
+        m_failed = true;
+    }
+    return m_failed ? -1 : 1;
+}
+
+/**
+ * @brief Pass 0 of the external merge sort algorithm.
+ *
+ * This function represents the initial pass of the external merge sort algorithm.
+ * It breaks down the records from the input file into blocks, sorts each block individually,
+ * and returns the blocks generated as runs.
+ * When the input does not fit in memory, the memory is split between the threads of the pool,
+ * each reading, sorting and writing its own blocks at the same time.
+ * With replacement selection, the blocks are instead produced one after another by a single heap,
+ * and their sizes depend on the order of the input.
+ * The blocks take turns over the output files, each keeping the index of its records in the input file.
+ * Reduced or limited blocks are shorter than their range of the input, and still start at its first index.
+ *
+ * @param in_file The input file containing the unsorted records.
+ * @param out_files The output files to store the sorted blocks of records.
+ * @param use_mmap Whether to read and write the files through memory mappings.
+ * @param out_codec The counters of the compression of the blocks, or null to write them raw.
+ * @param num_of_records Total number of records in the input file, or -1 if the input file is invalid.
+ * @return The blocks generated, whose files index 'out_files'.
+ */
+vector<RunSegment> ExtSorter::Pass0(const string &in_file, const vector<string> &out_files, bool use_mmap, CodecStats *out_codec, long &num_of_records)
+{
+    string in_file_name = in_file;
+    string out_file_name = out_files[0];
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    FileSorter<RecordView> sorter(in_file_name, out_file_name, m_config.amt_of_mem, m_config.sorting_order, m_config.text_mode, use_mmap,
+                                  nullptr, out_codec);
+    sorter.SetCounters(GetCounters());
+    sorter.SetReducer(GetReducer());
+    sorter.SetLimit(m_config.limit);
+    for (size_t i = 1; i < out_files.size(); i++)
+    {
+        sorter.AddOutputFile(out_files[i]);
+    }
+    num_of_records = sorter.GetNumRecords();
+    TracePhase("count", start, {make_pair("records", static_cast<double>(num_of_records))});
+    size_t num_of_buffers = sorter.GetBufferSize();
+    if (num_of_records < 0)
+    {
+        return vector<RunSegment>();
+    }
+
+    // Replacement selection mixes the order of the records with equal keys, which reducing them needs,
+    // and its runs cannot be cut at a limit
+    if (m_config.replacement_selection && !CutsOutput())
+    {
+        vector<RunSegment> runs;
+        if (sorter.ReplacementSelection(runs) != 1)
+        {
+            m_failed = true;
+        }
+        return runs;
+    }
+
+    // Each worker gets an equal share of the memory, a single block is sorted on its own
+    size_t block_size = num_of_buffers;
+    if (static_cast<size_t>(num_of_records) > num_of_buffers)
+    {
+        block_size = max<size_t>(1, num_of_buffers / m_pool.size());
+    }
+
+    long num_of_blocks = get_num_blocks(num_of_records, block_size);
+    vector<RunSegment> blocks(num_of_blocks);
+    for (long i = 0; i < num_of_blocks; i++)
+    {
+        // The last block holds the remaining records, which is a full block when they divide evenly
+        blocks[i].begin = i * block_size;
+        blocks[i].end = min<size_t>((i + 1) * block_size, num_of_records);
+        blocks[i].file = i % out_files.size();
+    }
+
+    // A single block is sorted by all threads of the pool, otherwise each thread sorts its own blocks in its share of the memory
+    sorter.SetNumOfWorkers(min<size_t>(m_pool.size(), num_of_blocks));
+    vector<size_t> num_of_written(num_of_blocks);
+    if (num_of_blocks == 1)
+    {
+        if (sorter.TwoPassMergeSort(0, blocks[0].end - 1, &m_pool, 0, &num_of_written[0]) != 1)
+        {
+            m_failed = true;
+        }
+        blocks[0].end = num_of_written[0];
+        return blocks;
+    }
+
+    // Sorts the blocks on the thread pool, at most one block per thread at a time
+    vector<int> results(num_of_blocks, 1);
+    for (long i = 0; i < num_of_blocks; i++)
+    {
+        m_pool.submit([&sorter, &blocks, &results, &num_of_written, i]()
+                      { results[i] = sorter.TwoPassMergeSort(blocks[i].begin, blocks[i].end - 1, nullptr, blocks[i].file, &num_of_written[i]); });
+    }
+    m_pool.wait();
+    if (count(results.begin(), results.end(), 1) != num_of_blocks)
+    {
+        m_failed = true;
+    }
+    for (long i = 0; i < num_of_blocks; i++)
+    {
+        blocks[i].end = blocks[i].begin + num_of_written[i];
+    }
+
+    return blocks;
+}
+
+/**
+ * @brief Perform a pass of the external merge sort algorithm.
+ *
+ * This function represents a pass (1, 2, ... n) of the external merge sort algorithm.
+ * Every group of sorted runs is merged into one larger sorted run, and the merged runs take turns over the output
+ * files, each placed after the records of the runs before it. The runs may come from any of the run files.
+ * The groups write disjoint parts of the output files, so they are merged concurrently on the thread pool.
+ * A pass that merges a single group splits it into key ranges instead, which are merged concurrently.
+ * Given an I/O pool, the reads and writes of the merges run in the background, overlapping the merging.
+ * Reduced or limited runs are shorter than their groups, and still start after the records of the groups before them.
+ *
+ * @param groups The groups of runs to merge, whose files index the run files.
+ * @param out_files The output files to store the merged runs.
+ * @param first_out_file_id The index given to the first output file in the returned runs, the next ones following it.
+ * @param use_mmap Whether to read and write the files through memory mappings.
+ * @return The merged runs, one per group.
+ */
+vector<RunSegment> ExtSorter::Pass(vector<vector<RunSegment>> groups, const vector<string> &out_files, size_t first_out_file_id, bool use_mmap)
+{
+    // Opens every run file read by the pass, the first one through the constructor
+    size_t num_of_files = m_run_file_names.size();
+    vector<size_t> sorter_file(num_of_files, num_of_files);
+    size_t first_file = 0;
+    if (!groups.empty() && !groups[0].empty())
+    {
+        first_file = groups[0][0].file;
+    }
+    string in_file_name = m_run_file_names[first_file];
+    string out_file_name = out_files[0];
+    CodecStats *out_codec = first_out_file_id < m_run_file_names.size() ? GetRunCodec() : nullptr; // The final output is never compressed
+    FileSorter<RecordView> sorter(in_file_name, out_file_name, m_config.amt_of_mem, m_config.sorting_order, false, use_mmap,
+                                  GetRunCodec(), out_codec);
+    for (size_t i = 1; i < out_files.size(); i++)
+    {
+        sorter.AddOutputFile(out_files[i]);
+    }
+    if (sorter.GetNumRecords() < 0)
+    {
+        m_failed = true;
+        return vector<RunSegment>();
+    }
+    sorter.SetIOPool(m_io_pool.get());
+    sorter.SetCounters(GetCounters());
+    sorter.SetReducer(GetReducer());
+    sorter.SetLimit(m_config.limit);
+    sorter_file[first_file] = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // Places every merged run after the records of the previous ones, in the output files in turn
+    vector<RunSegment> merged_runs(groups.size());
+    size_t out_start = 0;
+    size_t num_of_runs = 0;
+    size_t fan_in = 0;
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        num_of_runs += groups[i].size();
+        fan_in = max(fan_in, groups[i].size());
+        merged_runs[i].begin = out_start;
+        merged_runs[i].file = first_out_file_id + i % out_files.size();
+        for (size_t k = 0; k < groups[i].size(); k++)
+        {
+            RunSegment &run = groups[i][k];
+            if (sorter_file[run.file] == num_of_files)
+            {
+                sorter_file[run.file] = sorter.AddInputFile(m_run_file_names[run.file]);
+            }
+            run.file = sorter_file[run.file];
+            out_start += run.end - run.begin;
+        }
+        merged_runs[i].end = out_start;
+    }
+    sorter.ReserveOutput(out_start);
+
+    vector<size_t> num_of_written(groups.size());
+    if (groups.size() == 1)
+    {
+        if (sorter.PartitionedMergeSort(groups[0], merged_runs[0].begin, m_pool, 0, &num_of_written[0]) != 1)
+        {
+            m_failed = true;
+        }
+    }
+    else
+    {
+        // Only as many groups are merged at once as keep large enough I/O blocks, each worker merging every n-th group
+        size_t num_of_workers = min({m_pool.size(), groups.size(), sorter.GetNumOfMerges(fan_in)});
+        size_t num_of_out_files = out_files.size();
+        sorter.SetNumOfWorkers(num_of_workers);
+        vector<int> results(groups.size(), 1);
+        for (size_t w = 0; w < num_of_workers; w++)
+        {
+            m_pool.submit([&sorter, &groups, &merged_runs, &results, &num_of_written, w, num_of_workers, num_of_out_files]()
+                          {
+                              for (size_t i = w; i < groups.size(); i += num_of_workers)
+                              {
+                                  results[i] = sorter.TwoPassMergeSort(groups[i], merged_runs[i].begin, i % num_of_out_files, &num_of_written[i]);
+                              } });
+        }
+        m_pool.wait();
+        if (count(results.begin(), results.end(), 1) != static_cast<long>(groups.size()))
+        {
+            m_failed = true;
+        }
+    }
+    size_t num_of_merged = 0;
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        merged_runs[i].end = merged_runs[i].begin + num_of_written[i];
+        num_of_merged += num_of_written[i];
+    }
+
+    TracePhase(first_out_file_id < m_run_file_names.size() ? "merge_pass" : "final_merge", start,
+               {make_pair("fan_in", static_cast<double>(fan_in)), make_pair("runs", static_cast<double>(num_of_runs)),
+                make_pair("records", static_cast<double>(out_start)), make_pair("bytes_read", static_cast<double>(out_start) * SIZE_OF_REC),
+                make_pair("bytes_written", static_cast<double>(num_of_merged) * SIZE_OF_REC)});
+    return merged_runs;
+}
+
+/**
+ * @brief Runs the intermediate merge passes, until the runs left can be merged at once.
+ *
+ * Each pass merges just enough runs for the final merge to merge a full group (see plan_merge_pass),
+ * and writes the merged runs to a new run file.
+ *
+ * @param use_mmap Whether to read and write the files through memory mappings.
+ */
+void ExtSorter::MergeRuns(bool use_mmap)
+{
+    size_t fan_in = get_merge_fan_in(m_config.amt_of_mem, m_io_pool != nullptr, m_config.compress);
+    clog << "Merge fan-in: " << fan_in << ", passes: " << get_num_passes(m_runs.size(), fan_in) << endl;
+    while (m_runs.size() > fan_in && !m_failed)
+    {
+        vector<vector<RunSegment>> groups = plan_merge_pass(m_runs, fan_in, !m_reducer.empty());
+        size_t first_file = AddRunFiles(GetNumStripes(groups.size()));
+        vector<string> out_files(m_run_file_names.begin() + first_file, m_run_file_names.end());
+        vector<RunSegment> merged_runs = Pass(groups, out_files, first_file, use_mmap);
+        m_runs.insert(m_reducer.empty() ? m_runs.end() : m_runs.begin(), merged_runs.begin(), merged_runs.end());
+        m_stats.num_of_passes++;
+        RemoveUnusedRunFiles();
+    }
+}
+
+/**
+ * @brief Removes the run files that no run refers to anymore.
+ */
+void ExtSorter::RemoveUnusedRunFiles()
+{
+    vector<bool> used(m_run_file_names.size(), false);
+    for (size_t i = 0; i < m_runs.size(); i++)
+    {
+        used[m_runs[i].file] = true;
+    }
+    m_removed.resize(m_run_file_names.size(), false);
+    for (size_t i = 0; i < m_run_file_names.size(); i++)
+    {
+        if (!used[i] && !m_removed[i])
+        {
+            remove(m_run_file_names[i].c_str());
+            m_removed[i] = true;
+        }
+    }
+}
+
+/**
+ * @brief Sorts a file of records into another file.
+ *
+ * An input that fits in memory is sorted as a single block straight into the output file. Otherwise pass 0 writes
+ * sorted runs to a temporary file, which is renamed to the output file if it holds a single run, and the runs are
+ * merged over as few passes as the memory allows, the last one writing to the output file.
+ *
+ * @param in_file The input file containing the unsorted records.
+ * @param out_file The output file receiving the sorted records.
+ * @return 1 if the file was sorted, -1 otherwise.
+ */
+int ExtSorter::Sort(const string &in_file, const string &out_file)
+{
+    if (m_failed)
+    {
+        return -1;
+    }
+
+    // Lines, and records getting their keys normalized, are sorted as streams
+    if (m_config.variable_length || !m_key.empty())
+    {
+        FILE *in = fopen(in_file.c_str(), "rb");
+        FILE *out = in ? fopen(out_file.c_str(), "wb") : nullptr;
+        int sorted = -1;
+        if (!in || !out)
+        {
+            FileSorter<RecordView>::perror(-2);
+        }
+        else
+        {
+            sorted = SortStream(in, out);
+        }
+        if (in)
+        {
+            fclose(in);
+        }
+        if (out && fclose(out) != 0 && sorted == 1)
+        {
+            FileSorter<RecordView>::perror(-2);
+            sorted = -1;
+        }
+        if (out && sorted != 1)
+        {
+            remove(out_file.c_str());
+        }
+        return sorted;
+    }
+
+    RecordShapeScope scope(m_shape);
+
+    // Chooses between mapped and streamed I/O from the input size and the memory budget
+    struct stat st;
+    bool in_file_found = stat(in_file.c_str(), &st) == 0;
+    size_t in_file_size = in_file_found ? static_cast<size_t>(st.st_size) : 0;
+    bool use_mmap = in_file_found && UseMmap(in_file_size);
+    clog << "I/O mode: " << (use_mmap ? "mmap" : "streamed") << endl;
+
+    // The first records of a limited sort are selected in one pass when they fit in memory
+    size_t num_of_slots = static_cast<size_t>(m_config.amt_of_mem) * 1024 * 1024 / (SIZE_OF_REC * 2);
+    if (m_config.limit > 0 && m_config.limit <= num_of_slots && m_reducer.empty())
+    {
+        return SelectFirst(in_file, out_file, use_mmap);
+    }
+
+    // An input that fits in memory is sorted as a single block straight into the output file
+    bool in_memory = in_file_found && in_file_size / SIZE_OF_REC <= num_of_slots;
+    vector<string> tmp_files(1, out_file);
+    size_t first_file = m_run_file_names.size();
+    if (!in_memory)
+    {
+        // Pass 0 spreads its runs over all temporary directories
+        AddRunFiles(GetNumStripes(m_config.temp_dirs.size()));
+        tmp_files.assign(m_run_file_names.begin() + first_file, m_run_file_names.end());
+    }
+    long num_of_records;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<RunSegment> runs = Pass0(in_file, tmp_files, use_mmap, in_memory ? nullptr : GetRunCodec(), num_of_records);
+    m_stats.pass0_seconds += elapsed_ns(start) / 1e9;
+    m_stats.num_of_records = max(num_of_records, 0L);
+    m_stats.num_of_runs = in_memory ? min<size_t>(1, m_stats.num_of_records) : runs.size();
+    double num_of_bytes = static_cast<double>(m_stats.num_of_records) * SIZE_OF_REC;
+    TracePhase("pass0", start,
+               {make_pair("runs", static_cast<double>(m_stats.num_of_runs)), make_pair("records", static_cast<double>(m_stats.num_of_records)),
+                make_pair("bytes_read", num_of_bytes), make_pair("bytes_written", num_of_bytes)});
+    if (in_memory)
+    {
+        if (num_of_records < 0)
+        {
+            remove(out_file.c_str());
+            return -1;
+        }
+        if (CutsOutput() && !m_failed && !truncate_output(out_file, runs.empty() ? 0 : runs[0].end))
+        {
+            FileSorter<RecordView>::perror(-2);
+            m_failed = true;
+        }
+        return m_failed ? -1 : 1;
+    }
+    if (num_of_records < 0)
+    {
+        RemoveUnusedRunFiles();
+        return -1;
+    }
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        runs[i].file += first_file;
+    }
+
+    // A single sorted block already is the output, unless it is compressed
+    size_t single_file = runs.empty() ? first_file : runs[0].file;
+    if (runs.size() <= 1 && !m_config.compress && rename(m_run_file_names[single_file].c_str(), out_file.c_str()) == 0)
+    {
+        m_removed.resize(m_run_file_names.size(), false);
+        m_removed[single_file] = true;
+        RemoveUnusedRunFiles();
+        if (CutsOutput() && !m_failed && !truncate_output(out_file, runs.empty() ? 0 : runs[0].end))
+        {
+            FileSorter<RecordView>::perror(-2);
+            m_failed = true;
+        }
+        return m_failed ? -1 : 1;
+    }
+
+    m_runs = runs;
+    RemoveUnusedRunFiles();
+    start = chrono::steady_clock::now();
+    MergeRuns(use_mmap);
+
+    // The final pass merges straight into the output file
+    if (!m_failed)
+    {
+        vector<RunSegment> merged = Pass(vector<vector<RunSegment>>(1, m_runs), vector<string>(1, out_file), m_run_file_names.size(), use_mmap);
+        m_stats.num_of_passes++;
+        if (CutsOutput() && !m_failed && !truncate_output(out_file, merged[0].end))
+        {
+            FileSorter<RecordView>::perror(-2);
+            m_failed = true;
+        }
+    }
+    m_stats.merge_seconds += elapsed_ns(start) / 1e9;
+    m_runs.clear();
+    RemoveUnusedRunFiles();
+    ReportCompression();
+
+    return m_failed ? -1 : 1;
+}
+
+/**
+ * @brief Sorts the records read from a stream into another stream.
+ *
+ * The input is read sequentially in large blocks until its end, so it may be a pipe of unknown length.
+ * Its records are pushed and spilled as sorted runs, and the final merge is written to the output as it is pulled,
+ * so neither the input nor the output ever needs to be a seekable file.
+ *
+ * @param in The stream of unsorted records.
+ * @param out The stream receiving the sorted records.
+ * @return 1 if the stream was sorted, -1 otherwise.
+ */
+int ExtSorter::SortStream(FILE *in, FILE *out)
+{
+    if (m_config.variable_length)
+    {
+        return SortLines(in, out);
+    }
+
+    size_t rec_size = m_config.record_size;
+    vector<char> block(max<size_t>(1, MERGE_BLOCK_SIZE / rec_size) * rec_size);
+
+    // Pushes the whole records of every block read, a partial record is completed by the next read
+    size_t num_of_bytes = 0;
+    size_t num_of_records = 0;
+    size_t num_of_newlines = 0;
+    size_t n;
+    while ((n = fread(block.data() + num_of_bytes, 1, block.size() - num_of_bytes, in)) > 0)
+    {
+        if (m_config.text_mode)
+        {
+            const char *p = block.data() + num_of_bytes;
+            const char *end = p + n;
+            while ((p = static_cast<const char *>(memchr(p, '\n', end - p))) != nullptr)
+            {
+                num_of_newlines++;
+                p++;
+            }
+        }
+        num_of_bytes += n;
+        size_t whole = num_of_bytes / rec_size * rec_size;
+        for (size_t offset = 0; offset < whole; offset += rec_size)
+        {
+            if (Push(block.data() + offset) != 1)
+            {
+                return -1;
+            }
+        }
+        num_of_records += whole / rec_size;
+        num_of_bytes -= whole;
+        memmove(block.data(), block.data() + whole, num_of_bytes);
+    }
+    if (ferror(in))
+    {
+        FileSorter<RecordView>::perror(-2); // File IO error
+        return -1;
+    }
+    if (num_of_bytes != 0)
+    {
+        FileSorter<RecordView>::perror(-5); // Partial record at the end of the input
+        return -1;
+    }
+    if (m_config.text_mode && num_of_newlines != num_of_records)
+    {
+        FileSorter<RecordView>::perror(-6); // Lines are not records
+        return -1;
+    }
+
+    if (Finish() != 1)
+    {
+        return -1;
+    }
+
+    // Writes the sorted records in blocks as the final merge produces them
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (const char *record = Next(); record; record = Next())
+    {
+        memcpy(block.data() + num_of_bytes, record, rec_size);
+        num_of_bytes += rec_size;
+        if (num_of_bytes == block.size())
+        {
+            if (fwrite(block.data(), 1, num_of_bytes, out) != num_of_bytes)
+            {
+                FileSorter<RecordView>::perror(-2);
+                return -1;
+            }
+            num_of_bytes = 0;
+        }
+    }
+    if (m_failed || fwrite(block.data(), 1, num_of_bytes, out) != num_of_bytes || fflush(out) != 0)
+    {
+        FileSorter<RecordView>::perror(-2);
+        return -1;
+    }
+    if (m_merger)
+    {
+        m_counters.comparisons += m_merger->comparisons();
+        double num_of_records = static_cast<double>(m_stats.num_of_records);
+        TracePhase("final_merge", start,
+                   {make_pair("fan_in", static_cast<double>(m_runs.size())), make_pair("runs", static_cast<double>(m_runs.size())),
+                    make_pair("records", num_of_records), make_pair("bytes_read", num_of_records * m_shape.rec_size),
+                    make_pair("bytes_written", num_of_records * rec_size)});
+    }
+    ReportCompression();
+    return 1;
+}
+
+/**
+ * @brief Sorts newline-terminated lines of any length from a stream into another stream.
+ *
+ * The key of a line is its first 'key_size' bytes, or the whole line when it is shorter. Pass 0 reads the lines
+ * into a buffer of half the memory, each line stored once, and sorts an index of (key prefix, offset, length)
+ * entries over them. When the input does not fit, the lines of every full buffer are written as a run of
+ * length-framed lines, without padding, and the runs are merged as for fixed-size records.
+ * A last line without a newline gets one in the output, and a line longer than MAX_LINE_LENGTH fails the sort.
+ *
+ * @param in The stream of unsorted lines.
+ * @param out The stream receiving the sorted lines.
+ * @return 1 if the lines were sorted, -1 otherwise.
+ */
+int ExtSorter::SortLines(FILE *in, FILE *out)
+{
+    RecordShapeScope scope(m_shape);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // The lines and their index share half of the memory, like the records of pass 0
+    size_t budget = max<size_t>(MERGE_BLOCK_SIZE, static_cast<size_t>(m_config.amt_of_mem) * 1024 * 1024 / 2);
+    vector<char> buffer(budget);
+    vector<LineEntry> entries;
+    size_t num_of_bytes = 0; // Bytes read into the buffer
+    size_t parsed = 0;       // Start of the first line not indexed yet
+    bool at_end = false;
+    while (!at_end)
+    {
+        // Reads in blocks, so that the index never grows much past the budget
+        size_t n = fread(buffer.data() + num_of_bytes, 1, min(buffer.size() - num_of_bytes, MERGE_BLOCK_SIZE), in);
+        if (n == 0 && ferror(in))
+        {
+            FileSorter<RecordView>::perror(-2);
+            m_failed = true;
+            return -1;
+        }
+        at_end = n == 0;
+        num_of_bytes += n;
+
+        const char *newline;
+        while ((newline = static_cast<const char *>(memchr(buffer.data() + parsed, '\n', num_of_bytes - parsed))) != nullptr)
+        {
+            size_t length = newline - (buffer.data() + parsed);
+            if (length > MAX_LINE_LENGTH)
+            {
+                FileSorter<RecordView>::perror(-9); // Line too long for its stored length
+                m_failed = true;
+                return -1;
+            }
+            LineEntry entry = {line_prefix(buffer.data() + parsed, length, KEY_SIZE), parsed, static_cast<uint32_t>(length)};
+            entries.push_back(entry);
+            parsed += length + 1;
+        }
+        if (at_end && parsed < num_of_bytes)
+        {
+            size_t length = num_of_bytes - parsed;
+            if (length > MAX_LINE_LENGTH)
+            {
+                FileSorter<RecordView>::perror(-9); // Line too long for its stored length
+                m_failed = true;
+                return -1;
+            }
+            LineEntry entry = {line_prefix(buffer.data() + parsed, length, KEY_SIZE), parsed, static_cast<uint32_t>(length)};
+            entries.push_back(entry);
+            parsed = num_of_bytes;
+        }
+
+        if (!at_end && (num_of_bytes == buffer.size() || num_of_bytes + entries.size() * sizeof(LineEntry) >= budget))
+        {
+            if (entries.empty())
+            {
+                // A line longer than the buffer is read whole, the buffer growing past the budget until the next spill
+                if (num_of_bytes - parsed > MAX_LINE_LENGTH)
+                {
+                    FileSorter<RecordView>::perror(-9); // Line too long for its stored length
+                    m_failed = true;
+                    return -1;
+                }
+                if (num_of_bytes == buffer.size())
+                {
+                    buffer.resize(buffer.size() * 2);
+                }
+                continue;
+            }
+            if (SpillLines(buffer, entries) != 1)
+            {
+                return -1;
+            }
+            memmove(buffer.data(), buffer.data() + parsed, num_of_bytes - parsed);
+            num_of_bytes -= parsed;
+            parsed = 0;
+            entries.clear();
+            if (buffer.size() > budget && num_of_bytes <= budget)
+            {
+                buffer.resize(budget);
+                buffer.shrink_to_fit();
+            }
+        }
+    }
+
+    // Lines that all fit in memory are written straight to the output
+    if (m_runs.empty())
+    {
+        LineEntryPrecedes precedes = {buffer.data(), KEY_SIZE, m_config.sorting_order};
+        chrono::steady_clock::time_point sort_start = chrono::steady_clock::now();
+        sort_line_entries(entries, precedes, m_pool);
+        m_counters.sort_ns += elapsed_ns(sort_start);
+        LineWriter writer(out, MERGE_BLOCK_SIZE);
+        size_t num_of_lines = m_config.limit > 0 ? min<size_t>(m_config.limit, entries.size()) : entries.size();
+        for (size_t k = 0; k < num_of_lines; k++)
+        {
+            writer.write(buffer.data() + entries[k].offset, entries[k].length);
+        }
+        writer.flush();
+        m_stats.num_of_records = entries.size();
+        m_stats.num_of_runs = min<size_t>(1, entries.size());
+        m_stats.pass0_seconds += elapsed_ns(start) / 1e9;
+        TracePhase("pass0", start, {make_pair("runs", static_cast<double>(m_stats.num_of_runs)), make_pair("records", static_cast<double>(entries.size()))});
+        if (writer.failed())
+        {
+            FileSorter<RecordView>::perror(-2);
+            m_failed = true;
+            return -1;
+        }
+        return 1;
+    }
+
+    if (!entries.empty() && SpillLines(buffer, entries) != 1)
+    {
+        return -1;
+    }
+    vector<char>().swap(buffer);
+    vector<LineEntry>().swap(entries);
+    m_spills.clear();
+    m_stats.pass0_seconds += elapsed_ns(start) / 1e9;
+    TracePhase("pass0", start,
+               {make_pair("runs", static_cast<double>(m_stats.num_of_runs)), make_pair("records", static_cast<double>(m_stats.num_of_records)),
+                make_pair("bytes_written", static_cast<double>(m_num_of_spilled))});
+
+    // Intermediate passes write their merged runs to new run files, like MergeRuns()
+    start = chrono::steady_clock::now();
+    size_t fan_in = get_merge_fan_in(m_config.amt_of_mem, false, false);
+    clog << "Merge fan-in: " << fan_in << ", passes: " << get_num_passes(m_runs.size(), fan_in) << endl;
+    while (m_runs.size() > fan_in && !m_failed)
+    {
+        vector<vector<RunSegment>> groups = plan_merge_pass(m_runs, fan_in, false);
+        size_t first_file = AddRunFiles(GetNumStripes(groups.size()));
+        vector<RunSegment> merged_runs = LinePass(groups, first_file, nullptr);
+        m_runs.insert(m_runs.end(), merged_runs.begin(), merged_runs.end());
+        m_stats.num_of_passes++;
+        RemoveUnusedRunFiles();
+    }
+    if (!m_failed)
+    {
+        LinePass(vector<vector<RunSegment>>(1, m_runs), m_run_file_names.size(), out);
+        m_stats.num_of_passes++;
+    }
+    m_stats.merge_seconds += elapsed_ns(start) / 1e9;
+    m_runs.clear();
+    RemoveUnusedRunFiles();
+    return m_failed ? -1 : 1;
+}
+
+/**
+ * @brief Sorts the index of the lines in the buffer and appends the lines to a spill file as one run.
+ *
+ * Each run keeps the byte offset of its lines among all the bytes spilled, in the spill file of its turn.
+ *
+ * @param buffer The buffer holding the lines.
+ * @param entries The index of the lines, which is sorted.
+ * @return 1 if the run was written, -1 otherwise.
+ */
+int ExtSorter::SpillLines(const vector<char> &buffer, vector<LineEntry> &entries)
+{
+    if (m_spills.empty() && !OpenSpillFiles(1, nullptr))
+    {
+        return -1;
+    }
+    LineEntryPrecedes precedes = {buffer.data(), KEY_SIZE, m_config.sorting_order};
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    sort_line_entries(entries, precedes, m_pool);
+    m_counters.sort_ns += elapsed_ns(start);
+
+    size_t stripe = m_runs.size() % m_spills.size();
+    // A limited sort only needs the first lines of every run
+    LineWriter writer(m_spills[stripe]->fd(), m_num_of_spilled, MERGE_BLOCK_SIZE);
+    size_t run_size = 0;
+    size_t num_of_lines = m_config.limit > 0 ? min<size_t>(m_config.limit, entries.size()) : entries.size();
+    for (size_t k = 0; k < num_of_lines; k++)
+    {
+        writer.write(buffer.data() + entries[k].offset, entries[k].length);
+        run_size += LINE_LENGTH_SIZE + entries[k].length;
+    }
+    writer.flush();
+    if (writer.failed())
+    {
+        FileSorter<RecordView>::perror(-2);
+        m_failed = true;
+        return -1;
+    }
+
+    RunSegment run = {m_num_of_spilled, m_num_of_spilled + run_size, m_first_spill_file + stripe};
+    m_runs.push_back(run);
+    m_num_of_spilled += run_size;
+    m_stats.num_of_records += entries.size();
+    m_stats.num_of_runs++;
+    return 1;
+}
+
+/**
+ * @brief Performs a merge pass over runs of lines.
+ *
+ * Like Pass(), every group of runs is merged into one run, the merged runs taking turns over the new run files
+ * from 'first_out_file_id', and the groups are merged concurrently. Runs of lines are ranges of bytes,
+ * which merging keeps, so every merged run is placed after the bytes of the runs before it.
+ * Given an output stream, the single group is merged into it as newline-terminated lines instead, up to the limit.
+ *
+ * @param groups The groups of runs to merge, whose files index the run files.
+ * @param first_out_file_id The index of the first run file receiving the merged runs.
+ * @param out The stream receiving the lines of the final merge, or null.
+ * @return The merged runs, one per group.
+ */
+vector<RunSegment> ExtSorter::LinePass(const vector<vector<RunSegment>> &groups, size_t first_out_file_id, FILE *out)
+{
+    // Opens every run file read or written by the pass
+    vector<unique_ptr<RunFile>> files(m_run_file_names.size());
+    for (size_t file = 0; file < files.size(); file++)
+    {
+        bool output = file >= first_out_file_id;
+        bool input = false;
+        for (size_t i = 0; i < groups.size() && !input && !output; i++)
+        {
+            for (size_t k = 0; k < groups[i].size() && !input; k++)
+            {
+                input = groups[i][k].file == file;
+            }
+        }
+        if (!input && !output)
+        {
+            continue;
+        }
+        files[file].reset(new RunFile(1));
+        if (!files[file]->Open(m_run_file_names[file], output ? "wb" : "rb"))
+        {
+            FileSorter<RecordView>::perror(-2);
+            m_failed = true;
+            return vector<RunSegment>();
+        }
+    }
+
+    // Places every merged run after the bytes of the previous ones, in the output files in turn
+    size_t num_of_out_files = max<size_t>(1, m_run_file_names.size() - first_out_file_id);
+    vector<RunSegment> merged_runs(groups.size());
+    size_t out_start = 0;
+    size_t max_group_size = 0;
+    for (size_t i = 0; i < groups.size(); i++)
+    {
+        merged_runs[i].begin = out_start;
+        merged_runs[i].file = first_out_file_id + i % num_of_out_files;
+        for (size_t k = 0; k < groups[i].size(); k++)
+        {
+            out_start += groups[i][k].end - groups[i][k].begin;
+        }
+        merged_runs[i].end = out_start;
+        max_group_size = max(max_group_size, groups[i].size());
+    }
+
+    // The memory is split between the blocks of the merges running at once, which are only as many as keep large enough blocks
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t mem_in_bytes = static_cast<size_t>(m_config.amt_of_mem) * 1024 * 1024;
+    size_t num_of_workers = min({m_pool.size(), groups.size(), max<size_t>(1, mem_in_bytes / ((max_group_size + 1) * MIN_MERGE_BLOCK_SIZE))});
+    size_t block_size = max<size_t>(MIN_MERGE_BLOCK_SIZE, mem_in_bytes / (num_of_workers * (max_group_size + 1)));
+    vector<int> results(groups.size(), 1);
+    long key_size = KEY_SIZE;
+    int sorting_order = m_config.sorting_order;
+    size_t limit = out && m_config.limit > 0 ? m_config.limit : SIZE_MAX; // Merged runs keep all their bytes
+    for (size_t w = 0; w < num_of_workers; w++)
+    {
+        m_pool.submit([&files, &groups, &merged_runs, &results, out, block_size, key_size, sorting_order, limit, w, num_of_workers]()
+                      {
+                          for (size_t i = w; i < groups.size(); i += num_of_workers)
+                          {
+                              LineWriter writer = out ? LineWriter(out, block_size)
+                                                      : LineWriter(files[merged_runs[i].file]->fd(), merged_runs[i].begin, block_size);
+                              results[i] = merge_line_runs(groups[i], files, writer, block_size, key_size, sorting_order, limit) ? 1 : -1;
+                          } });
+    }
+    m_pool.wait();
+    if (count(results.begin(), results.end(), 1) != static_cast<long>(groups.size()))
+    {
+        FileSorter<RecordView>::perror(-2);
+        m_failed = true;
+    }
+    TracePhase(out ? "final_merge" : "merge_pass", start,
+               {make_pair("fan_in", static_cast<double>(max_group_size)), make_pair("bytes_read", static_cast<double>(out_start))});
+    return merged_runs;
+}
+
+/**
+ * @brief Adds a record to sort.
+ *
+ * Records are gathered in memory; when the memory is full they are sorted and spilled to a run file.
+ *
+ * @param record A pointer to the raw data of the record, 'record_size' bytes long.
+ * @return 1 if the record was added, -1 if spilling failed or Finish() was already called.
+ */
+int ExtSorter::Push(const char *record)
+{
+    if (m_finished || m_failed)
+    {
+        return -1;
+    }
+    if (!m_arena)
+    {
+        // The pushed records get half of the memory, like the blocks of pass 0
+        size_t capacity = static_cast<size_t>(m_config.amt_of_mem) * 1024 * 1024 / (m_shape.rec_size * 2);
+        if (m_config.limit > 0 && m_config.limit <= capacity && m_reducer.empty())
+        {
+            // The first records of a limited sort are selected in the arena, which then never spills
+            m_arena.reset(new RecordArena(m_shape.rec_size, m_config.limit));
+            m_top_k.reset(new TopKHeap<RecordView>(*m_arena, m_config.sorting_order));
+        }
+        else
+        {
+            m_arena.reset(new RecordArena(m_shape.rec_size, max<size_t>(1, capacity)));
+        }
+    }
+    if (!m_key.empty())
+    {
+        m_key.Normalize(record, m_keyed.data());
+        memcpy(m_keyed.data() + m_key.size(), record, m_config.record_size);
+        record = m_keyed.data();
+    }
+    if (m_top_k)
+    {
+        RecordShapeScope scope(m_shape);
+        m_top_k->Offer(record);
+        m_num_of_offered++;
+        return 1;
+    }
+    if (!m_arena->Push(record))
+    {
+        if (Spill() != 1)
+        {
+            return -1;
+        }
+        m_arena->Push(record);
+    }
+    if (!m_reducer.empty())
+    {
+        m_reducer.Init((*m_arena)[m_arena->size() - 1]);
+    }
+    return 1;
+}
+
+/**
+ * @brief Creates the spill files, which the spilled runs take turns over, one per temporary directory.
+ *
+ * @param rec_size The size of the records of the files, 1 for files of lines.
+ * @param codec The counters of the compression of the runs, or null to write them raw.
+ * @return True if the files were created, otherwise false.
+ */
+bool ExtSorter::OpenSpillFiles(size_t rec_size, CodecStats *codec)
+{
+    m_first_spill_file = AddRunFiles(GetNumStripes(m_config.temp_dirs.size()));
+    for (size_t file = m_first_spill_file; file < m_run_file_names.size(); file++)
+    {
+        m_spills.push_back(unique_ptr<RunFile>(new RunFile(rec_size)));
+        m_spills.back()->SetCodec(codec);
+        m_spills.back()->SetCounters(GetCounters());
+        if (!m_spills.back()->Open(m_run_file_names[file], "wb"))
+        {
+            FileSorter<RecordView>::perror(-2);
+            m_failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Sorts the pushed records held in memory and appends them to the spill file as one run.
+ *
+ * @return 1 if the run was written, -1 otherwise.
+ */
+int ExtSorter::Spill()
+{
+    RecordShapeScope scope(m_shape);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (m_spills.empty() && !OpenSpillFiles(SIZE_OF_REC, GetRunCodec()))
+    {
+        return -1;
+    }
+
+    // Each run keeps the index of its records among all the records spilled
+    size_t stripe = m_runs.size() % m_spills.size();
+    size_t block_size = max<size_t>(1, MERGE_BLOCK_SIZE / SIZE_OF_REC);
+    RunWriter writer = m_spills[stripe]->OpenWriter(m_num_of_spilled, block_size, m_io_pool.get());
+    size_t num_of_records = m_arena->size();
+    if (!m_reducer.empty())
+    {
+        // A limited sort only needs the first keys of every run. Runs of records that are not reduced need no cut:
+        // a limit that fits in memory is selected by the TopKHeap, so every spilled run is already shorter than it
+        ReduceStream stream(m_reducer, SIZE_OF_REC, true);
+        size_t limit = m_config.limit > 0 ? m_config.limit : SIZE_MAX;
+        num_of_records = 0;
+        sort_arena<RecordView>(*m_arena, m_config.sorting_order, &m_pool, [&writer, &stream, &num_of_records, limit](const char *record)
+                               {
+                                   const char *reduced = stream.Add(record);
+                                   if (reduced && num_of_records < limit)
+                                   {
+                                       writer.write(reduced);
+                                       num_of_records++;
+                                   } });
+        const char *reduced = stream.Flush();
+        if (reduced && num_of_records < limit)
+        {
+            writer.write(reduced);
+            num_of_records++;
+        }
+    }
+    else
+    {
+        sort_arena<RecordView>(*m_arena, m_config.sorting_order, &m_pool, [&writer](const char *record)
+                               { writer.write(record); });
+    }
+    m_counters.sort_ns += elapsed_ns(start) - writer.wait_ns();
+    writer.flush();
+    if (writer.failed())
+    {
+        FileSorter<RecordView>::perror(-2);
+        m_failed = true;
+        return -1;
+    }
+
+    RunSegment run = {m_num_of_spilled, m_num_of_spilled + num_of_records, m_first_spill_file + stripe};
+    m_runs.push_back(run);
+    m_num_of_spilled += num_of_records;
+    m_stats.num_of_records += m_arena->size();
+    m_stats.num_of_runs++;
+    m_stats.pass0_seconds += elapsed_ns(start) / 1e9;
+    TracePhase("spill", start,
+               {make_pair("records", static_cast<double>(m_arena->size())),
+                make_pair("bytes_written", static_cast<double>(num_of_records) * SIZE_OF_REC)});
+    m_arena->clear();
+    return 1;
+}
+
+/**
+ * @brief Ends the input and prepares the sorted records to be read with Next().
+ *
+ * Records that never left memory are sorted in place. Otherwise the last records are spilled, the intermediate
+ * merge passes are run, and the remaining runs are opened for the final merge, which is done by Next().
+ *
+ * @return 1 on success, -1 otherwise.
+ */
+int ExtSorter::Finish()
+{
+    if (m_finished)
+    {
+        return m_failed ? -1 : 1;
+    }
+    m_finished = true;
+    if (m_failed)
+    {
+        return -1;
+    }
+    RecordShapeScope scope(m_shape);
+
+    // Nothing was spilled, the records are sorted in memory
+    if (m_spills.empty())
+    {
+        if (m_arena)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            m_sorted.reserve(m_arena->size());
+            if (!m_reducer.empty())
+            {
+                // The reduced records are copied to an arena of their own, as the sort hands them over
+                ReduceStream stream(m_reducer, SIZE_OF_REC, true);
+                m_reduced.reset(new RecordArena(SIZE_OF_REC, m_arena->size()));
+                sort_arena<RecordView>(*m_arena, m_config.sorting_order, &m_pool, [this, &stream](const char *record)
+                                       {
+                                           const char *reduced = stream.Add(record);
+                                           if (reduced)
+                                           {
+                                               m_reduced->Push(reduced);
+                                           } });
+                if (const char *reduced = stream.Flush())
+                {
+                    m_reduced->Push(reduced);
+                }
+                for (size_t k = 0; k < m_reduced->size(); k++)
+                {
+                    m_sorted.push_back((*m_reduced)[k]);
+                }
+            }
+            else
+            {
+                sort_arena<RecordView>(*m_arena, m_config.sorting_order, &m_pool, [this](const char *record)
+                                       { m_sorted.push_back(record); });
+            }
+            // A selection reports every record pushed, not only the ones it kept, like SelectFirst()
+            m_stats.num_of_records = m_top_k ? m_num_of_offered : m_arena->size();
+            m_stats.num_of_runs = min<size_t>(1, m_arena->size());
+            m_stats.pass0_seconds += elapsed_ns(start) / 1e9;
+            m_counters.sort_ns += elapsed_ns(start);
+            TracePhase("sort", start, {make_pair("records", static_cast<double>(m_stats.num_of_records))});
+        }
+        return 1;
+    }
+
+    if (m_arena->size() > 0 && Spill() != 1)
+    {
+        return -1;
+    }
+    m_arena.reset();
+    m_spills.clear();
+    RemoveUnusedRunFiles();
+
+    bool use_mmap = UseMmap(m_num_of_spilled * SIZE_OF_REC);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    MergeRuns(use_mmap);
+    m_stats.merge_seconds += elapsed_ns(start) / 1e9;
+    if (m_failed)
+    {
+        return -1;
+    }
+    m_stats.num_of_passes++;
+
+    // Opens the runs left for the final merge, the memory being split between their readers
+    m_pull_files.resize(m_run_file_names.size());
+    size_t num_of_blocks = m_runs.size() * (m_io_pool ? 2 : 1);
+    size_t io_block_size = max<size_t>(1, static_cast<size_t>(m_config.amt_of_mem) * 1024 * 1024 / (num_of_blocks * SIZE_OF_REC));
+    vector<RunReader> readers;
+    readers.reserve(m_runs.size());
+    for (size_t i = 0; i < m_runs.size(); i++)
+    {
+        size_t file = m_runs[i].file;
+        if (!m_pull_files[file])
+        {
+            m_pull_files[file].reset(new RunFile(SIZE_OF_REC));
+            m_pull_files[file]->SetCodec(GetRunCodec());
+            m_pull_files[file]->SetCounters(GetCounters());
+            size_t size = 0;
+            if (!m_pull_files[file]->Open(m_run_file_names[file], "rb") || !m_pull_files[file]->GetSize(size))
+            {
+                FileSorter<RecordView>::perror(-2);
+                m_failed = true;
+                return -1;
+            }
+            if (use_mmap)
+            {
+                m_pull_files[file]->Map(size / SIZE_OF_REC, false);
+            }
+        }
+        readers.push_back(m_pull_files[file]->OpenReader(m_runs[i].begin, m_runs[i].end, io_block_size, m_io_pool.get()));
+    }
+    m_merger.reset(new RunMerger(move(readers), m_config.sorting_order));
+    if (!m_reducer.empty())
+    {
+        m_reduce_stream.reset(new ReduceStream(m_reducer, SIZE_OF_REC, false));
+    }
+    return 1;
+}
+
+/**
+ * @brief Returns the next record in sorted order, once Finish() was called.
+ *
+ * @return A pointer to the raw data of the record, valid until the next call, or null after the last record or on error.
+ */
+const char *ExtSorter::Next()
+{
+    if (!m_finished || m_failed || (m_config.limit > 0 && m_next >= m_config.limit))
+    {
+        return nullptr;
+    }
+    // The normalized key in front of the records is skipped
+    if (!m_merger)
+    {
+        return m_next < m_sorted.size() ? m_sorted[m_next++] + m_key.size() : nullptr;
+    }
+
+    RecordShapeScope scope(m_shape);
+    if (m_reduce_stream)
+    {
+        // Merges records until one completes a key, the stable merge handing them in the order of the input
+        for (; !m_merger->empty(); m_merger->advance())
+        {
+            if (const char *reduced = m_reduce_stream->Add(m_merger->current()))
+            {
+                m_merger->advance();
+                m_next++;
+                return reduced + m_key.size();
+            }
+        }
+        const char *reduced = m_merger->failed() ? nullptr : m_reduce_stream->Flush();
+        if (reduced)
+        {
+            m_next++;
+            return reduced + m_key.size();
+        }
+    }
+    else if (m_next++ > 0 && !m_merger->empty())
+    {
+        m_merger->advance();
+    }
+    if (m_merger->failed())
+    {
+        FileSorter<RecordView>::perror(-2);
+        m_failed = true;
+        return nullptr;
+    }
+    return m_merger->empty() ? nullptr : m_merger->current() + m_key.size();
+}
+
+/**
+ * @brief Returns what the sort did so far and how long its phases took.
+ *
+ * @return The statistics of the sort.
+ */
+const SortStats &ExtSorter::GetStats() const
+{
+    return m_stats;
+}
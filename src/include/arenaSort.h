@@ -0,0 +1,132 @@
+#ifndef ARENASORT_H
+#define ARENASORT_H
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <recordArena.h>
+#include <keyPrefix.h>
+#include <radixSort.h>
+#include <threadPool.h>
+
+using namespace std;
+
+/**
+ * @brief Sorts the records of an arena through views and hands them to a sink in sorted order.
+ *
+ * Each view is a pointer into the arena, so sorting only moves pointers.
+ *
+ * @param arena The arena holding the records to sort.
+ * @param sorting_order The sorting order (1 for ascending, 0 for descending).
+ * @param sink Called with a pointer to each record of the arena, in sorted order.
+ */
+template <typename Rec, typename Sink>
+void sort_arena_by_views(const RecordArena &arena, int sorting_order, Sink sink)
+{
+    vector<Rec> buffer;
+    buffer.reserve(arena.size());
+    for (size_t k = 0; k < arena.size(); k++)
+    {
+        buffer.push_back(Rec(arena[k]));
+    }
+
+    if (sorting_order == 1)
+    {
+        // sort in ascending order
+        sort(buffer.begin(), buffer.end());
+    }
+    else
+    {
+        // sort in descending order
+        sort(buffer.begin(), buffer.end(), greater<Rec>());
+    }
+
+    for (size_t k = 0; k < buffer.size(); k++)
+    {
+        sink(buffer[k].data());
+    }
+}
+
+/**
+ * @brief Sorts the records of an arena through key-prefix entries and hands them to a sink in sorted order.
+ *
+ * The entries hold a normalized key prefix and the index of the record, so most comparisons are a single
+ * integer compare within a compact array. The records themselves are only touched again by the sink.
+ * Runs of at least RADIX_SORT_MIN_SIZE records are sorted with msd_radix_sort instead of comparisons.
+ *
+ * @param arena The arena holding the records to sort.
+ * @param sorting_order The sorting order (1 for ascending, 0 for descending).
+ * @param pool The thread pool radix sorting the buckets concurrently, or null.
+ * @param sink Called with a pointer to each record of the arena, in sorted order.
+ */
+template <typename Sink>
+void sort_arena_by_key_prefix(const RecordArena &arena, int sorting_order, ThreadPool *pool, Sink sink)
+{
+    vector<KeyPrefixEntry> entries(arena.size());
+    for (size_t k = 0; k < arena.size(); k++)
+    {
+        entries[k].prefix = key_prefix(arena[k]);
+        entries[k].index = k;
+    }
+
+    // Large runs are radix sorted on the key bytes of the prefixes
+    bool radix = entries.size() >= RADIX_SORT_MIN_SIZE;
+    KeyPrefixEntry *begin = entries.data();
+    KeyPrefixEntry *end = begin + entries.size();
+    if (sorting_order == 1)
+    {
+        // sort in ascending order
+        KeyPrefixLess less_than = {&arena};
+        if (radix)
+        {
+            msd_radix_sort(begin, end, 0, false, less_than, pool);
+        }
+        else
+        {
+            sort(begin, end, less_than);
+        }
+    }
+    else
+    {
+        // sort in descending order
+        KeyPrefixGreater greater_than = {&arena};
+        if (radix)
+        {
+            msd_radix_sort(begin, end, 0, true, greater_than, pool);
+        }
+        else
+        {
+            sort(begin, end, greater_than);
+        }
+    }
+
+    for (size_t k = 0; k < entries.size(); k++)
+    {
+        sink(arena[entries[k].index]);
+    }
+}
+
+/**
+ * @brief Sorts the records of an arena and hands them to a sink in sorted order.
+ *
+ * Records are sorted through key-prefix entries or record views, as chosen by use_key_prefix_sort().
+ *
+ * @param arena The arena holding the records to sort.
+ * @param sorting_order The sorting order (1 for ascending, 0 for descending).
+ * @param pool The thread pool sorting in parallel, or null to sort on the calling thread.
+ * @param sink Called with a pointer to each record of the arena, in sorted order.
+ */
+template <typename Rec, typename Sink>
+void sort_arena(const RecordArena &arena, int sorting_order, ThreadPool *pool, Sink sink)
+{
+    if (use_key_prefix_sort())
+    {
+        sort_arena_by_key_prefix(arena, sorting_order, pool, sink);
+    }
+    else
+    {
+        sort_arena_by_views<Rec>(arena, sorting_order, sink);
+    }
+}
+
+#endif
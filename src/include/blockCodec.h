@@ -0,0 +1,273 @@
+#ifndef BLOCKCODEC_H
+#define BLOCKCODEC_H
+
+#include <cstdint>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * @brief Byte and time counters of the compression of run blocks, shared by all readers and writers of a sort.
+ */
+struct CodecStats
+{
+    atomic<uint64_t> raw_bytes;        // Bytes given to the compressor
+    atomic<uint64_t> compressed_bytes; // Bytes written by the compressor, frame headers included
+    atomic<uint64_t> compress_ns;      // Time spent compressing
+    atomic<uint64_t> decompress_ns;    // Time spent decompressing
+
+    CodecStats() : raw_bytes(0), compressed_bytes(0), compress_ns(0), decompress_ns(0) {}
+};
+
+/**
+ * @brief Returns the time elapsed since 'start' in nanoseconds.
+ */
+inline uint64_t elapsed_ns(chrono::steady_clock::time_point start)
+{
+    return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+// Size of the hash table of the compressor, as a power of two
+const int LZ_HASH_BITS = 14;
+
+// Shortest match worth encoding
+const size_t LZ_MIN_MATCH = 4;
+
+// Farthest match that an offset of two bytes reaches
+const size_t LZ_MAX_OFFSET = 65535;
+
+/**
+ * @brief Hashes the 4 bytes at 'p' into an index of the compressor's hash table.
+ */
+inline uint32_t lz_hash(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief Appends a length of the token's 4-bit field, continued with bytes of 255 when it does not fit.
+ *
+ * @return The position after the length bytes, or null if they do not fit before 'end'.
+ */
+inline unsigned char *lz_write_length(unsigned char *op, unsigned char *end, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (op == end)
+        {
+            return nullptr;
+        }
+        *op++ = 255;
+    }
+    if (op == end)
+    {
+        return nullptr;
+    }
+    *op++ = static_cast<unsigned char>(length);
+    return op;
+}
+
+/**
+ * @brief Appends one sequence of the LZ4 block format: literals followed by a match, or by nothing for the last one.
+ *
+ * @return The position after the sequence, or null if it does not fit before 'end'.
+ */
+inline unsigned char *lz_write_sequence(unsigned char *op, unsigned char *end, const unsigned char *literals, size_t num_of_literals, size_t offset, size_t match_length)
+{
+    if (op == end)
+    {
+        return nullptr;
+    }
+    unsigned char *token = op++;
+    size_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+    *token = static_cast<unsigned char>((min<size_t>(num_of_literals, 15) << 4) | min<size_t>(match_code, 15));
+    if (num_of_literals >= 15 && !(op = lz_write_length(op, end, num_of_literals - 15)))
+    {
+        return nullptr;
+    }
+    if (static_cast<size_t>(end - op) < num_of_literals)
+    {
+        return nullptr;
+    }
+    memcpy(op, literals, num_of_literals);
+    op += num_of_literals;
+    if (match_length == 0)
+    {
+        return op;
+    }
+    if (end - op < 2)
+    {
+        return nullptr;
+    }
+    *op++ = static_cast<unsigned char>(offset & 0xFF);
+    *op++ = static_cast<unsigned char>(offset >> 8);
+    if (match_code >= 15 && !(op = lz_write_length(op, end, match_code - 15)))
+    {
+        return nullptr;
+    }
+    return op;
+}
+
+/**
+ * @brief Compresses a block with a greedy LZ77 coder in the LZ4 block format.
+ *
+ * Matches are found through a hash table of the last position of every 4-byte sequence, and positions that keep
+ * missing are skipped faster, so incompressible data costs little time.
+ *
+ * @param src The data to compress.
+ * @param n The size of the data.
+ * @param dst The destination buffer.
+ * @param capacity The size of the destination buffer.
+ * @return The compressed size, or 0 if it would not be smaller than 'capacity'.
+ */
+inline size_t lz_compress(const char *src, size_t n, char *dst, size_t capacity)
+{
+    const unsigned char *base = reinterpret_cast<const unsigned char *>(src);
+    const unsigned char *end = base + n;
+    unsigned char *op = reinterpret_cast<unsigned char *>(dst);
+    unsigned char *op_end = op + capacity;
+    const unsigned char *anchor = base; // Start of the pending literals
+
+    if (n > LZ_MIN_MATCH)
+    {
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+        const unsigned char *match_limit = end - LZ_MIN_MATCH; // Last position where 4 bytes can be hashed
+        const unsigned char *ip = base + 1;
+        size_t misses = 0;
+        while (ip <= match_limit)
+        {
+            uint32_t h = lz_hash(ip);
+            const unsigned char *candidate = base + table[h];
+            table[h] = static_cast<uint32_t>(ip - base);
+            if (candidate < ip && static_cast<size_t>(ip - candidate) <= LZ_MAX_OFFSET && memcmp(candidate, ip, LZ_MIN_MATCH) == 0)
+            {
+                size_t length = LZ_MIN_MATCH;
+                while (ip + length < end && candidate[length] == ip[length])
+                {
+                    length++;
+                }
+                op = lz_write_sequence(op, op_end, anchor, ip - anchor, ip - candidate, length);
+                if (!op)
+                {
+                    return 0;
+                }
+                ip += length;
+                anchor = ip;
+                misses = 0;
+            }
+            else
+            {
+                ip += 1 + (misses++ >> 6);
+            }
+        }
+    }
+
+    op = lz_write_sequence(op, op_end, anchor, end - anchor, 0, 0);
+    if (!op || op == op_end)
+    {
+        return 0;
+    }
+    return op - reinterpret_cast<unsigned char *>(dst);
+}
+
+/**
+ * @brief Reads a length continued with bytes of 255 after a token field of 15.
+ *
+ * @return False if the input ends before the length.
+ */
+inline bool lz_read_length(const unsigned char *&ip, const unsigned char *end, size_t &length)
+{
+    unsigned char b;
+    do
+    {
+        if (ip == end)
+        {
+            return false;
+        }
+        b = *ip++;
+        length += b;
+    } while (b == 255);
+    return true;
+}
+
+/**
+ * @brief Decompresses a block compressed by lz_compress.
+ *
+ * Every length and offset is checked against the buffers, so corrupted input fails instead of overrunning them.
+ *
+ * @param src The compressed data.
+ * @param n The size of the compressed data.
+ * @param dst The destination buffer.
+ * @param out_n The size of the decompressed data.
+ * @return True if exactly 'out_n' bytes were decompressed, otherwise false.
+ */
+inline bool lz_decompress(const char *src, size_t n, char *dst, size_t out_n)
+{
+    const unsigned char *ip = reinterpret_cast<const unsigned char *>(src);
+    const unsigned char *end = ip + n;
+    unsigned char *base = reinterpret_cast<unsigned char *>(dst);
+    unsigned char *op = base;
+    unsigned char *op_end = op + out_n;
+
+    while (ip < end)
+    {
+        unsigned char token = *ip++;
+        size_t num_of_literals = token >> 4;
+        if (num_of_literals == 15 && !lz_read_length(ip, end, num_of_literals))
+        {
+            return false;
+        }
+        if (static_cast<size_t>(end - ip) < num_of_literals || static_cast<size_t>(op_end - op) < num_of_literals)
+        {
+            return false;
+        }
+        memcpy(op, ip, num_of_literals);
+        ip += num_of_literals;
+        op += num_of_literals;
+        if (ip == end)
+        {
+            break; // The last sequence has no match
+        }
+
+        if (end - ip < 2)
+        {
+            return false;
+        }
+        size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !lz_read_length(ip, end, length))
+        {
+            return false;
+        }
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > static_cast<size_t>(op - base) || static_cast<size_t>(op_end - op) < length)
+        {
+            return false;
+        }
+
+        // Matches may overlap their own output, so they are copied byte by byte when they are close
+        const unsigned char *match = op - offset;
+        if (offset >= length)
+        {
+            memcpy(op, match, length);
+            op += length;
+        }
+        else
+        {
+            for (size_t i = 0; i < length; i++)
+            {
+                *op++ = match[i];
+            }
+        }
+    }
+    return op == op_end;
+}
+
+#endif
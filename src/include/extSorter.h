@@ -0,0 +1,164 @@
+#ifndef EXTSORTER_H
+#define EXTSORTER_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <recordShape.h>
+#include <recordArena.h>
+#include <runFile.h>
+#include <runMerger.h>
+#include <threadPool.h>
+#include <fileSorter.h>
+#include <lineRun.h>
+#include <keySpec.h>
+#include <recordReducer.h>
+#include <sortTrace.h>
+
+using namespace std;
+
+/**
+ * @brief The settings of one external sort.
+ */
+struct SortConfig
+{
+    long record_size;           // Size of each record in bytes
+    long key_size;              // Size of the key at the start of each record in bytes, unless 'key_spec' is given
+    int sorting_order;          // 1 for ascending, 0 for descending
+    int amt_of_mem;             // Memory limit in MB
+    size_t num_of_threads;      // Threads sorting and merging, 0 for the number of cores
+    size_t num_of_io_threads;   // Threads prefetching and writing behind the blocks of merges, 0 for synchronous I/O
+    bool replacement_selection; // Whether pass 0 generates its runs with replacement selection
+    bool text_mode;             // Whether the records of the input file are newline-terminated lines
+    bool compress;              // Whether the temporary run files are compressed
+    bool variable_length;       // Whether the records are newline-terminated lines of any length, see SortLines()
+    string io_mode;             // "auto", "mmap" or "stream", see the --io-mode option
+    string key_spec;            // Fields of the key anywhere in the record, see KeySpec, or empty for the first 'key_size' bytes
+    string unique;              // "first" or "last" to keep one record per key, see RecordReducer, or empty to keep them all
+    string combine;             // Numeric fields combined over the records of each key, see RecordReducer, or empty
+    size_t limit;               // Number of records output, the first ones in the sorting order, or 0 for all of them
+    string trace_file;          // File receiving a trace of the phases of the sorts, or empty to trace nothing
+    string trace_format;        // "jsonl" or "chrome", see SortTrace
+    string temp_prefix;         // Prefix of the names of the temporary run files
+    vector<string> temp_dirs;   // Directories receiving the temporary run files in turn, the current directory if empty
+
+    SortConfig()
+        : record_size(100), key_size(8), sorting_order(1), amt_of_mem(32), num_of_threads(0), num_of_io_threads(1),
+          replacement_selection(false), text_mode(false), compress(false), variable_length(false), io_mode("auto"), limit(0), trace_format("jsonl") {}
+};
+
+/**
+ * @brief What one external sort did and how long its phases took.
+ */
+struct SortStats
+{
+    size_t num_of_records;
+    size_t num_of_runs;   // Sorted runs produced by pass 0, or by the spills of pushed records
+    size_t num_of_passes; // Merge passes over the runs, the final merge included
+    double pass0_seconds; // Time spent producing the runs
+    double merge_seconds; // Time spent merging the runs, without the final merge pulled by Next()
+
+    SortStats() : num_of_records(0), num_of_runs(0), num_of_passes(0), pass0_seconds(0), merge_seconds(0) {}
+};
+
+/**
+ * @brief An external merge sort of fixed-size records, usable as a library.
+ *
+ * A sorter either sorts a whole file into another with Sort(), or takes records one at a time with Push(),
+ * after which Finish() and Next() stream the sorted records back without writing an output file.
+ * SortStream() does both for streams of unknown length such as pipes.
+ * Pushed records are gathered in memory and spilled to temporary run files as sorted runs when the memory is full;
+ * when they all fit in memory, they are never written to disk.
+ * With 'variable_length', Sort() and SortStream() sort newline-terminated lines of any length instead, while
+ * Push() still takes records of 'record_size' bytes.
+ * With a 'key_spec', every record gets its normalized key in front of it as it is pushed, which is sorted on
+ * with plain byte comparisons and stripped again from the records returned by Next(); Sort() then streams the
+ * file through Push() and Next() as SortStream() does.
+ *
+ * With 'unique' or 'combine', every run, and the output, holds one record per key: pass 0 reduces each sorted block
+ * and every merge reduces its runs, which it takes in the order of the input, so that the first or last record
+ * of each key is the first or last of the input. Replacement selection is then not used.
+ *
+ * With a 'limit', only the first records in sorting order are output. When they fit in memory, they are selected in
+ * one pass through a bounded heap (see TopKHeap) and nothing is spilled; otherwise every run is cut to the limit
+ * and every merge stops at it.
+ *
+ * Given a trace file, the phases of the sorts are recorded with their times, I/O waits, comparisons and peak memory,
+ * and written to the file when the sorter is destroyed.
+ *
+ * Each sorter carries its own record shape and thread pools, so sorters of different record sizes can be used
+ * in one process, from different threads as long as each sorter is used by one thread at a time.
+ * All methods return 1 on success and -1 on failure, after printing the error.
+ */
+class ExtSorter
+{
+    SortConfig m_config;
+    KeySpec m_key;       // Fields of the key, normalized in front of every record, or empty
+    RecordReducer m_reducer; // Reduction of the records with equal keys, or empty
+    RecordShape m_shape; // Shape of the records sorted, normalized key included
+    ThreadPool m_pool;
+    unique_ptr<ThreadPool> m_io_pool;
+    CodecStats m_codec_stats; // Compression of the run files, when they are compressed
+    string m_job_name;        // Name of the sort, unique to the process and the sorter, starting every run file name
+    SortStats m_stats;
+    SortTrace m_trace;          // Phases of the sorts, when tracing
+    PhaseCounters m_counters;   // Counters of the phase running, when tracing
+
+    vector<string> m_run_file_names; // Temporary run files, indexed by RunSegment::file
+    vector<bool> m_removed;          // Whether each run file has been removed
+    vector<RunSegment> m_runs;       // Sorted runs left to merge
+
+    unique_ptr<RecordArena> m_arena; // Records pushed since the last spill
+    unique_ptr<TopKHeap<RecordView>> m_top_k; // Selection of the first 'limit' pushed records into the arena, when they fit
+    size_t m_num_of_offered;         // Number of records pushed into the selection of m_top_k
+    vector<char> m_keyed;            // A pushed record behind its normalized key
+    vector<unique_ptr<RunFile>> m_spills; // Run files receiving the spilled runs in turn
+    size_t m_first_spill_file;            // Index of the first spill file in the run files
+    size_t m_num_of_spilled;         // Number of records in the spill files, or of their bytes for lines
+
+    vector<const char *> m_sorted;                  // Records sorted in memory, when nothing was spilled
+    unique_ptr<RecordArena> m_reduced;              // Reduced records sorted in memory, when reducing
+    unique_ptr<ReduceStream> m_reduce_stream;       // Reduction of the final merge, when reducing
+    vector<unique_ptr<RunFile>> m_pull_files;       // Run files read by the final merge, indexed by RunSegment::file
+    unique_ptr<RunMerger> m_merger;                 // Final merge of the runs
+    size_t m_next;                                  // Number of records returned by Next()
+    bool m_finished;
+    bool m_failed;
+
+    ExtSorter(const ExtSorter &);
+    ExtSorter &operator=(const ExtSorter &);
+
+    size_t AddRunFiles(size_t num_of_files);
+    size_t GetNumStripes(size_t num_of_runs);
+    bool UseMmap(size_t file_size);
+    CodecStats *GetRunCodec();
+    void ReportCompression();
+    PhaseCounters *GetCounters();
+    const RecordReducer *GetReducer();
+    bool CutsOutput();
+    void TracePhase(const string &name, chrono::steady_clock::time_point start, vector<pair<string, double>> args);
+    int SelectFirst(const string &in_file, const string &out_file, bool use_mmap);
+    vector<RunSegment> Pass0(const string &in_file, const vector<string> &out_files, bool use_mmap, CodecStats *out_codec, long &num_of_records);
+    vector<RunSegment> Pass(vector<vector<RunSegment>> groups, const vector<string> &out_files, size_t first_out_file_id, bool use_mmap);
+    void MergeRuns(bool use_mmap);
+    void RemoveUnusedRunFiles();
+    bool OpenSpillFiles(size_t rec_size, CodecStats *codec);
+    int Spill();
+    int SortLines(FILE *in, FILE *out);
+    int SpillLines(const vector<char> &buffer, vector<LineEntry> &entries);
+    vector<RunSegment> LinePass(const vector<vector<RunSegment>> &groups, size_t first_out_file_id, FILE *out);
+
+public:
+    explicit ExtSorter(const SortConfig &config);
+    ~ExtSorter();
+
+    int Sort(const string &in_file, const string &out_file);
+    int SortStream(FILE *in, FILE *out);
+    int Push(const char *record);
+    int Finish();
+    const char *Next();
+    const SortStats &GetStats() const;
+};
+
+#endif
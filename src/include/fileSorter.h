@@ -2,60 +2,197 @@
 #define FILESORTER_H
 
 #include <iostream>
-#include <fstream>
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <cstdint>
 #include <string>
+#include <memory>
 #include <buffer.h>
+#include <runIO.h>
+#include <runFile.h>
+#include <recordArena.h>
+#include <arenaSort.h>
+#include <threadPool.h>
+#include <runMerger.h>
+#include <recordReducer.h>
 
 using namespace std;
 
-extern long SIZE_OF_REC;
+extern thread_local long SIZE_OF_REC;
 
+// Smallest number of records worth merging as a separate key range
+const size_t MIN_PARTITION_SIZE = 4096;
+
+// Smallest I/O block in bytes that keeps the reads of a merge sequential, which bounds the merge fan-in
+const size_t MERGE_BLOCK_SIZE = 256 * 1024;
+
+// Smallest I/O block in bytes left to each stream when concurrent merges or key ranges share the memory
+const size_t MIN_MERGE_BLOCK_SIZE = 64 * 1024;
+
+// Number of blocks of the output of a pass-0 sort that would take up the memory of its worker
+const size_t PASS0_WRITER_SHARE = 8;
+
+/**
+ * @brief A range [begin, end) of record indices of an input file holding one sorted run, or a piece of it.
+ *
+ * 'file' is 0 for the input file of the sorter, or the index returned by FileSorter::AddInputFile.
+ */
+struct RunSegment
+{
+    size_t begin;
+    size_t end;
+    size_t file;
+};
+
+/**
+ * @brief A record tagged with the number of the run it will be written to during replacement selection.
+ *
+ * The operators order entries of an earlier run first, whatever the sorting order, and compare records within a run.
+ * The min-heap of a Buffer (ascending) then tops the smallest record of the earliest run, and the max-heap
+ * (descending) tops the largest record of the earliest run.
+ * Each entry caches the normalized prefix of its key (see key_prefix), so the sift comparisons of the heap
+ * only reach the records when the prefixes are equal and the key is longer than the prefix.
+ */
 template <typename Rec>
-struct RecWithBlockIndex
+struct RecWithRunNumber
 {
     Rec value;
-    size_t index;
+    size_t run;
+    uint64_t prefix;
 };
 
 template <typename Rec>
-bool operator<(const RecWithBlockIndex<Rec> &r1, const RecWithBlockIndex<Rec> &r2)
+bool operator<(const RecWithRunNumber<Rec> &r1, const RecWithRunNumber<Rec> &r2)
 {
-    return r1.value < r2.value;
+    if (r1.run != r2.run)
+    {
+        return r1.run > r2.run;
+    }
+    if (r1.prefix != r2.prefix)
+    {
+        return r1.prefix < r2.prefix;
+    }
+    return KEY_SIZE > KEY_PREFIX_SIZE && r1.value < r2.value;
 }
 
 template <typename Rec>
-bool operator>(const RecWithBlockIndex<Rec> &r1, const RecWithBlockIndex<Rec> &r2)
+bool operator>(const RecWithRunNumber<Rec> &r1, const RecWithRunNumber<Rec> &r2)
 {
-    return r1.value > r2.value;
+    if (r1.run != r2.run)
+    {
+        return r1.run > r2.run;
+    }
+    if (r1.prefix != r2.prefix)
+    {
+        return r1.prefix > r2.prefix;
+    }
+    return KEY_SIZE > KEY_PREFIX_SIZE && r1.value > r2.value;
 }
 
+/**
+ * @brief Keeps the first 'k' records, in the sorting order, of the records offered to it.
+ *
+ * The records kept are held in an arena of 'k' records, and a Buffer heap of the reverse order tops the last of them.
+ * Once the arena is full, a record that comes before that last record takes its slot, and any other record is
+ * dropped after one comparison, mostly of the cached key prefixes. Records with equal keys keep the earliest one.
+ */
+template <typename Rec>
+class TopKHeap
+{
+    RecordArena &m_arena;
+    Buffer<RecWithRunNumber<Rec>> m_heap;
+    int m_sorting_order;
+
+public:
+    /**
+     * @param arena The arena receiving the records kept, whose capacity is 'k'.
+     * @param sorting_order The sorting order (1 for ascending, 0 for descending).
+     */
+    TopKHeap(RecordArena &arena, int sorting_order)
+        : m_arena(arena), m_heap(max<size_t>(1, arena.capacity()), sorting_order == 1 ? 0 : 1), m_sorting_order(sorting_order) {}
+
+    /**
+     * @brief Offers a record, which is copied if it is among the first 'k' records so far.
+     *
+     * @param record A pointer to the raw data of the record.
+     */
+    void Offer(const char *record)
+    {
+        uint64_t prefix = key_prefix(record);
+        char *slot;
+        if (m_arena.size() < m_arena.capacity())
+        {
+            m_arena.Push(record);
+            slot = m_arena[m_arena.size() - 1];
+        }
+        else
+        {
+            if (m_arena.capacity() == 0)
+            {
+                return;
+            }
+            RecWithRunNumber<Rec> candidate = {Rec(record), 0, prefix};
+            RecWithRunNumber<Rec> last = m_heap.top();
+            if (!(m_sorting_order == 1 ? candidate < last : candidate > last))
+            {
+                return;
+            }
+            slot = m_arena[(last.value.data() - m_arena[0]) / SIZE_OF_REC];
+            m_heap.pop();
+            memcpy(slot, record, SIZE_OF_REC);
+        }
+        RecWithRunNumber<Rec> entry = {Rec(slot), 0, prefix};
+        m_heap.push(entry);
+    }
+};
+
 template <typename Rec>
 class FileSorter
 {
-    FILE *m_h_inpfile; // handle to input file
-    FILE *m_h_outfile; // handle to output file
+    vector<unique_ptr<RunFile>> m_inputs;  // Input files, the first one given to the constructor
+    vector<unique_ptr<RunFile>> m_outputs; // Output files, the first one given to the constructor
     long m_lnrecords;  // Number of records in file.
     int m_i_amt_of_mem;
     int m_sorting_order;
+    size_t m_num_of_workers; // Number of sorts or merges sharing the memory at the same time
+    ThreadPool *m_io_pool;   // Threads prefetching and writing behind the blocks of merges, or null
+    bool m_use_mmap;         // Whether files are read and written through memory mappings
+    CodecStats *m_in_codec;  // Counters of the compression of the input runs, or null if they are raw
+    CodecStats *m_out_codec; // Counters of the compression of the output runs, or null if they are raw
+    PhaseCounters *m_counters; // Counters of the phase run by the sorter, or null
+    const RecordReducer *m_reducer; // Reduction of the records with equal keys, or null
+    size_t m_limit;          // Number of records kept by every run, the first ones in the sorting order, or 0 for all
 
-    long CountRecords(string &inFile);
-    Rec ReadRecord(size_t index);
-    void WriteRecord(size_t index, Rec value);
-    size_t GetRecordIndex(size_t start_block, size_t end_block, vector<size_t> block_sizes, size_t start_record, size_t end_block_offset);
-    RecWithBlockIndex<Rec> CreateRecWithBlockIndex(const Rec &value, size_t index);
+    long CountRecords(bool text_mode);
+    size_t GetIOBlockSize(size_t num_of_streams);
+    size_t LowerBound(const RunSegment &segment, const Rec &key);
 
 public:
-    FileSorter(string &inFile, string &outFile, int amt_of_mem, int sorting_order);
+    FileSorter(string &inFile, string &outFile, int amt_of_mem, int sorting_order, bool text_mode = false, bool use_mmap = false,
+               CodecStats *in_codec = nullptr, CodecStats *out_codec = nullptr);
     ~FileSorter();
 
-    int TwoPassMergeSort(long i, long j);
-    int TwoPassMergeSort(size_t start_block, vector<size_t> block_sizes, size_t num_of_blocks_to_merge, size_t start_record, size_t end_record);
+    int TwoPassMergeSort(long i, long j, ThreadPool *pool = nullptr, size_t out_file = 0, size_t *num_of_written = nullptr);
+    int ReplacementSelection(vector<RunSegment> &runs);
+    int TopK(size_t k);
+    int TwoPassMergeSort(const vector<RunSegment> &segments, size_t out_start, size_t out_file = 0, size_t *num_of_written = nullptr);
+    int PartitionedMergeSort(const vector<RunSegment> &segments, size_t out_start, ThreadPool &pool, size_t out_file = 0,
+                             size_t *num_of_written = nullptr);
+    size_t AddInputFile(const string &inFile);
+    size_t AddOutputFile(const string &outFile);
+    void ReserveOutput(size_t num_of_records);
+    void SetNumOfWorkers(size_t num_of_workers);
+    size_t GetNumOfMerges(size_t num_of_segments);
+    void SetIOPool(ThreadPool *io_pool);
+    void SetCounters(PhaseCounters *counters);
+    void SetReducer(const RecordReducer *reducer);
+    void SetLimit(size_t limit);
     size_t GetBufferSize();
     long GetNumRecords();
+    bool IsMapped();
 
-    void perror(int x);
+    static void perror(int x);
 };
 
 /**
@@ -68,304 +205,828 @@ public:
  * @param outFile The output file name.
  * @param amt_of_mem The amount of memory available for sorting.
  * @param sorting_order The sorting order (1 for ascending, 0 for descending).
+ * @param text_mode Whether the input holds newline-terminated records, which are checked while counting.
+ * @param use_mmap Whether to read and write the files through memory mappings instead of streamed I/O.
+ * @param in_codec The counters of the compression of the input files, or null if they are raw.
+ *                 Compressed input files only hold runs to merge, so their records are not counted.
+ * @param out_codec The counters of the compression of the output file, or null to write it raw.
  */
 template <typename Rec>
-FileSorter<Rec>::FileSorter(string &inFile, string &outFile, int amt_of_mem, int sorting_order)
+FileSorter<Rec>::FileSorter(string &inFile, string &outFile, int amt_of_mem, int sorting_order, bool text_mode, bool use_mmap,
+                            CodecStats *in_codec, CodecStats *out_codec)
+    : m_lnrecords(-1), m_in_codec(in_codec), m_out_codec(out_codec), m_counters(nullptr), m_reducer(nullptr), m_limit(0)
 {
+    // Set amount of memory
+    m_i_amt_of_mem = amt_of_mem;
+
+    // Set sortinrg order
+    m_sorting_order = sorting_order;
+
+    m_num_of_workers = 1;
+    m_io_pool = nullptr;
+    m_use_mmap = use_mmap;
+
     // Open input file
-    m_h_inpfile = fopen(inFile.c_str(), "rb");
-    if (!m_h_inpfile)
+    m_inputs.push_back(unique_ptr<RunFile>(new RunFile(SIZE_OF_REC)));
+    m_inputs[0]->SetCodec(in_codec);
+    if (!m_inputs[0]->Open(inFile, "rb"))
     {
         perror(-2); // File IO error
-        fclose(m_h_inpfile);
         return;
     }
 
     // Open output file
-    m_h_outfile = fopen(outFile.c_str(), "wb");
-    if (!m_h_outfile)
+    m_outputs.push_back(unique_ptr<RunFile>(new RunFile(SIZE_OF_REC)));
+    m_outputs[0]->SetCodec(out_codec);
+    if (!m_outputs[0]->Open(outFile, "wb"))
     {
         perror(-2); // File IO error
-        fclose(m_h_outfile);
         return;
     }
 
-    // Set amount of memory
-    m_i_amt_of_mem = amt_of_mem;
-
-    // Set sortinrg order
-    m_sorting_order = sorting_order;
+    m_lnrecords = in_codec ? 0 : CountRecords(text_mode);
 
-    m_lnrecords = CountRecords(inFile);
+    // By default the output holds as many records as the input
+    if (m_use_mmap && m_lnrecords > 0)
+    {
+        m_inputs[0]->Map(m_lnrecords, false);
+        ReserveOutput(m_lnrecords);
+    }
 }
 
 /**
  * @brief Destructs the FileSorter object.
  *
- * This destructor closes the input and output files if they are open.
+ * The input and output files unmap and close themselves.
  */
 template <typename Rec>
 FileSorter<Rec>::~FileSorter()
 {
-    // Close input and output files if they are open
-    if (m_h_inpfile)
-        fclose(m_h_inpfile);
-    if (m_h_outfile)
-        fclose(m_h_outfile);
+}
+
+/**
+ * @brief Opens another input file holding runs to merge.
+ *
+ * @param inFile The input file name.
+ * @return The index of the file, to be used as RunSegment::file.
+ */
+template <typename Rec>
+size_t FileSorter<Rec>::AddInputFile(const string &inFile)
+{
+    m_inputs.push_back(unique_ptr<RunFile>(new RunFile(SIZE_OF_REC)));
+    RunFile &input = *m_inputs.back();
+    input.SetCodec(m_in_codec);
+    input.SetCounters(m_counters);
+    size_t size = 0;
+    if (!input.Open(inFile, "rb") || !input.GetSize(size))
+    {
+        perror(-2); // File IO error
+    }
+    else if (m_use_mmap)
+    {
+        input.Map(size / SIZE_OF_REC, false);
+    }
+    return m_inputs.size() - 1;
+}
+
+/**
+ * @brief Opens another output file, so that runs can be spread over several files, e.g. on different disks.
+ *
+ * Records keep their index in every output file, so each file only holds the runs written to it and the
+ * ranges of the other files are left as holes. In mapped mode, the file is reserved like the first output.
+ * If the file cannot be opened, GetNumRecords() reports the failure.
+ *
+ * @param outFile The output file name.
+ * @return The index of the file, to be given as 'out_file' to the sorts and merges.
+ */
+template <typename Rec>
+size_t FileSorter<Rec>::AddOutputFile(const string &outFile)
+{
+    m_outputs.push_back(unique_ptr<RunFile>(new RunFile(SIZE_OF_REC)));
+    RunFile &output = *m_outputs.back();
+    output.SetCodec(m_out_codec);
+    output.SetCounters(m_counters);
+    if (!output.Open(outFile, "wb"))
+    {
+        perror(-2); // File IO error
+        m_lnrecords = -1;
+    }
+    else if (m_use_mmap && m_lnrecords > 0)
+    {
+        output.Map(m_lnrecords, true);
+    }
+    return m_outputs.size() - 1;
+}
+
+/**
+ * @brief Sets the number of records that will be written to the output files.
+ *
+ * In mapped mode, every output file is resized and mapped to hold exactly that many records.
+ * Streamed output grows as it is written, so nothing needs to be done.
+ *
+ * @param num_of_records The number of records of the output files.
+ */
+template <typename Rec>
+void FileSorter<Rec>::ReserveOutput(size_t num_of_records)
+{
+    if (m_use_mmap)
+    {
+        for (size_t i = 0; i < m_outputs.size(); i++)
+        {
+            m_outputs[i]->Map(num_of_records, true);
+        }
+    }
 }
 
 /**
  * @brief Counts the number of records in the input file.
  *
- * This function opens the input file and counts the number of records present in it.
+ * The count is taken from the size of the input file, which must hold a whole number of records.
+ * In text mode, the newlines of the file are also counted with one memchr scan over large blocks,
+ * and every record must be one newline-terminated line.
  *
- * @param inFile The input file name.
+ * @param text_mode Whether the records are newline-terminated lines.
  * @return The number of records in the input file, or -1 if an error occurs.
  */
 template <typename Rec>
-long FileSorter<Rec>::CountRecords(string &inFile)
+long FileSorter<Rec>::CountRecords(bool text_mode)
 {
-    // Open input file
-    ifstream inpFile_stream(inFile);
-    if (!inpFile_stream.is_open())
+    size_t file_size = 0;
+    if (!m_inputs[0]->GetSize(file_size))
     {
         perror(-2); // File IO error
         return -1;
     }
 
-    // Count the number of records in the input file
-    long num_of_records = 0;
-    string line;
-    while (getline(inpFile_stream, line))
+    if (file_size % SIZE_OF_REC != 0)
     {
-        ++num_of_records; // Increment record count for each line
+        perror(-5); // Trailing partial record
+        return -1;
+    }
+    long num_of_records = static_cast<long>(file_size / SIZE_OF_REC);
+
+    if (text_mode)
+    {
+        // Counts the newlines of the input file in large blocks
+        vector<char> block(min(GetBufferSize() * SIZE_OF_REC, file_size));
+        long num_of_lines = 0;
+        for (size_t offset = 0; offset < file_size; offset += block.size())
+        {
+            size_t n = min(block.size(), file_size - offset);
+            if (!read_fully(m_inputs[0]->fd(), block.data(), n, offset))
+            {
+                perror(-2);
+                return -1;
+            }
+            const char *end = block.data() + n;
+            for (const char *p = block.data(); (p = static_cast<const char *>(memchr(p, '\n', end - p))) != nullptr; p++)
+            {
+                num_of_lines++;
+            }
+        }
+        if (num_of_lines != num_of_records)
+        {
+            perror(-6); // Lines are not records
+            return -1;
+        }
     }
-    inpFile_stream.close(); // Close the input file stream
 
     return num_of_records;
 }
 
 /**
- * @brief Reads a record from the input file at the specified index.
+ * @brief Calculates the number of buffers available based on the amount of memory.
  *
- * This function seeks to the specified index in the input file and reads a record.
+ * This function computes the number of buffers available using the amount of memory allocated to the sorter.
+ * The amount of memory available is provided in megabytes (MB), hence it's converted to bytes by multiplying by 1024*1024.
+ * Then, it divides the available memory in bytes by the size of each record multiplied by 2 (assuming each buffer holds twice the size of a record)
+ * to determine the number of buffers available.
  *
- * @param index The index of the record to read.
- * @return The record read from the input file.
+ * @return The number of buffers available based on the allocated memory.
  */
 template <typename Rec>
-Rec FileSorter<Rec>::ReadRecord(size_t index)
+size_t FileSorter<Rec>::GetBufferSize()
 {
-    fseek(m_h_inpfile, index * SIZE_OF_REC, SEEK_SET);
-    Rec record(m_h_inpfile);
-    return record;
+    return static_cast<size_t>(m_i_amt_of_mem) * 1024 * 1024 / (SIZE_OF_REC * 2);
 }
 
 /**
- * @brief Writes a record to the output file at the specified index.
+ * @brief Sets the number of merges that run at the same time.
  *
- * This function seeks to the specified index in the output file and writes a record.
+ * Each of them gets an equal share of the memory for its I/O blocks.
  *
- * @param index The index where the record should be written.
- * @param value The record to write to the output file.
+ * @param num_of_workers Number of concurrent merges.
  */
 template <typename Rec>
-void FileSorter<Rec>::WriteRecord(size_t index, Rec value)
+void FileSorter<Rec>::SetNumOfWorkers(size_t num_of_workers)
 {
-    fseek(m_h_outfile, index * SIZE_OF_REC, SEEK_SET);
-    fwrite(value.data(), SIZE_OF_REC, 1, m_h_outfile);
+    m_num_of_workers = max<size_t>(1, num_of_workers);
 }
 
 /**
- * @brief Calculates the index of a record in the file based on block sizes.
- *
- * This function calculates the absolute index of a record in the file given the indices of the starting and ending blocks,
- * the sizes of individual blocks, the index of the starting record within the starting block,
- * and the offset within the ending block.
- *
- * @param start_block The index of the starting block.
- * @param end_block The index of the ending block.
- * @param block_sizes Vector containing the sizes of individual blocks.
- * @param start_record The index of the starting record.
- * @param end_block_offset The offset within the ending block.
- * @return The index of the record in the file.
+ * @brief Calculates how many merges can run at the same time while each keeps large enough I/O blocks.
+ *
+ * The fan-in gives every run of a single merge, and the output, a block of at least MERGE_BLOCK_SIZE bytes.
+ * Concurrent merges and key ranges share that memory down to blocks of MIN_MERGE_BLOCK_SIZE bytes,
+ * two of them with asynchronous I/O, plus a frame buffer when compressed, so even merges of a full fan-in
+ * still run on several threads.
+ *
+ * @param num_of_segments Number of ranges read by each merge.
+ * @return The number of merges that fit in memory at once (at least 1).
  */
 template <typename Rec>
-size_t FileSorter<Rec>::GetRecordIndex(size_t start_block, size_t end_block, vector<size_t> block_sizes, size_t start_record, size_t end_block_offset)
+size_t FileSorter<Rec>::GetNumOfMerges(size_t num_of_segments)
 {
-    size_t record_index = start_record;
-    for (size_t i = start_block; i < end_block; i++)
+    size_t mem_in_bytes = static_cast<size_t>(m_i_amt_of_mem) * 1024 * 1024;
+    size_t block_size = max<size_t>(MIN_MERGE_BLOCK_SIZE, SIZE_OF_REC) * (m_io_pool ? 2 : 1);
+    if (m_in_codec || m_out_codec)
     {
-        record_index += block_sizes[i];
+        block_size += FRAME_HEADER_SIZE + max<size_t>(COMPRESSED_FRAME_SIZE, SIZE_OF_REC);
     }
-    record_index += end_block_offset;
-    return record_index;
+    return max<size_t>(1, mem_in_bytes / ((num_of_segments + 1) * block_size));
 }
 
 /**
- * @brief Creates an instance RecordWithBlockIndex object.
+ * @brief Sets the thread pool running the asynchronous I/O of merges.
  *
- * This function creates a RecordWithBlockIndex object containing a record and the index of block that it belongs to.
+ * With a pool, merges prefetch the next block of every run and write full output blocks behind,
+ * which takes two blocks of memory per stream. Without one, merges read and write synchronously.
  *
- * @param value The record value.
- * @param index The index of the block.
- * @return A RecordWithBlockIndex object containing the record value and its index.
+ * @param io_pool The I/O thread pool, or null for synchronous I/O.
  */
 template <typename Rec>
-RecWithBlockIndex<Rec> FileSorter<Rec>::CreateRecWithBlockIndex(const Rec &value, size_t index)
+void FileSorter<Rec>::SetIOPool(ThreadPool *io_pool)
 {
-    RecWithBlockIndex<Rec> r;
-    r.value = value;
-    r.index = index;
-    return r;
+    m_io_pool = io_pool;
 }
 
 /**
- * @brief Calculates the number of buffers available based on the amount of memory.
+ * @brief Sets the counters of the time and work of the sorts and merges, for tracing.
  *
- * This function computes the number of buffers available using the amount of memory allocated to the sorter.
- * The amount of memory available is provided in megabytes (MB), hence it's converted to bytes by multiplying by 1024*1024.
- * Then, it divides the available memory in bytes by the size of each record multiplied by 2 (assuming each buffer holds twice the size of a record)
- * to determine the number of buffers available.
+ * The readers and writers of every file count their I/O time, pass 0 its sort time and merges their comparisons.
  *
- * @return The number of buffers available based on the allocated memory.
+ * @param counters The counters of the phase, or null to count nothing.
  */
 template <typename Rec>
-size_t FileSorter<Rec>::GetBufferSize()
+void FileSorter<Rec>::SetCounters(PhaseCounters *counters)
 {
-    return static_cast<size_t>(m_i_amt_of_mem) * 1024 * 1024 / (SIZE_OF_REC * 2);
+    m_counters = counters;
+    for (size_t i = 0; i < m_inputs.size(); i++)
+    {
+        m_inputs[i]->SetCounters(counters);
+    }
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        m_outputs[i]->SetCounters(counters);
+    }
+}
+
+/**
+ * @brief Sets how the sorts and merges reduce the records with equal keys.
+ *
+ * Pass 0 reduces every sorted range, and merges reduce the records of their runs, so each run holds one record
+ * per key and is written shorter than its input. Merges then expect their runs in the order of the input.
+ * Replacement selection does not reduce its runs.
+ *
+ * @param reducer The reduction, or null to keep every record.
+ */
+template <typename Rec>
+void FileSorter<Rec>::SetReducer(const RecordReducer *reducer)
+{
+    m_reducer = reducer;
+}
+
+/**
+ * @brief Makes the sorts and merges write only the first records of their runs.
+ *
+ * Only the first 'limit' records of the output are wanted, so no run needs more: pass 0 writes the first 'limit'
+ * records of every sorted range, and merges stop after their first 'limit' records, as do merges of reduced runs
+ * after 'limit' keys.
+ *
+ * @param limit The number of records kept by every run, or 0 to keep them all.
+ */
+template <typename Rec>
+void FileSorter<Rec>::SetLimit(size_t limit)
+{
+    m_limit = limit;
+}
+
+/**
+ * @brief Calculates the number of records per I/O block when memory is shared by several streams.
+ *
+ * The memory share of one worker (see SetNumOfWorkers) is split evenly between 'num_of_streams' run readers and writers,
+ * so each of them transfers one large contiguous block per read or write.
+ *
+ * @param num_of_streams Number of readers and writers sharing the memory.
+ * @return The number of records in each I/O block (at least 1).
+ */
+template <typename Rec>
+size_t FileSorter<Rec>::GetIOBlockSize(size_t num_of_streams)
+{
+    size_t mem_in_bytes = static_cast<size_t>(m_i_amt_of_mem) * 1024 * 1024 / m_num_of_workers;
+    return max<size_t>(1, mem_in_bytes / (max<size_t>(1, num_of_streams) * SIZE_OF_REC));
 }
 
 /**
  * @brief Sorts records within a specified range.
  *
  * This method sorts records in the file from record index 'i' to 'j'.
- * It reads records into a buffer, sorts them either in ascending or descending order based on the sorting order,
- * and then writes the sorted records to the output file.
+ * It loads the records into a contiguous RecordArena with one sequential read, sorts them either in ascending or descending order
+ * based on the sorting order, and then writes the sorted records to the output file in large blocks.
+ * Records are sorted through key-prefix entries or record views, as chosen by sort_arena().
+ * Ranges that do not overlap may be sorted from several threads at once.
+ * With a reducer (see SetReducer), only one record per key is written, from index 'i', and with a limit
+ * (see SetLimit) only the first records.
  *
  * @param i The starting index of the range of records to be sorted.
  * @param j The ending index of the range of records to be sorted.
- * @return An integer indicating the success of the sorting operation (1 for success).
+ * @param pool The thread pool sorting the range in parallel, or null to sort it on the calling thread.
+ * @param out_file The index of the output file receiving the sorted range, see AddOutputFile.
+ * @param num_of_written Receives the number of records written, or null.
+ * @return An integer indicating the success of the sorting operation (1 for success, -1 for failure).
  */
 template <typename Rec>
-int FileSorter<Rec>::TwoPassMergeSort(long i, long j)
+int FileSorter<Rec>::TwoPassMergeSort(long i, long j, ThreadPool *pool, size_t out_file, size_t *num_of_written)
 {
-    vector<Rec> buffer(GetBufferSize());
-
-    long records_read = 0;
-    for (long cur_record_idx = i; cur_record_idx <= j; cur_record_idx++)
+    // Reads the whole range into one contiguous arena with one large sequential read
+    RecordArena arena(SIZE_OF_REC, j - i + 1);
+    if (!m_inputs[0]->LoadArena(arena, i, j - i + 1))
     {
-        Rec record = ReadRecord(cur_record_idx);
-        buffer[records_read++] = record;
+        perror(-2);
+        return -1;
     }
 
-    if (m_sorting_order == 1)
+    // The arena holds half of the worker's memory and its sort entries part of the rest, so the writer gets an eighth
+    RunWriter writer = m_outputs[out_file]->OpenWriter(i, GetIOBlockSize(PASS0_WRITER_SHARE));
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t num_of_records = arena.size();
+    size_t limit = m_limit > 0 ? m_limit : SIZE_MAX;
+    if (m_reducer)
     {
-        // sort in ascending order
-        sort(buffer.begin(), buffer.begin() + records_read);
+        for (size_t k = 0; k < arena.size(); k++)
+        {
+            m_reducer->Init(arena[k]);
+        }
+        ReduceStream stream(*m_reducer, SIZE_OF_REC, true);
+        num_of_records = 0;
+        sort_arena<Rec>(arena, m_sorting_order, pool, [&writer, &stream, &num_of_records, limit](const char *record)
+                        {
+                            const char *reduced = stream.Add(record);
+                            if (reduced && num_of_records < limit)
+                            {
+                                writer.write(reduced);
+                                num_of_records++;
+                            } });
+        const char *reduced = stream.Flush();
+        if (reduced && num_of_records < limit)
+        {
+            writer.write(reduced);
+            num_of_records++;
+        }
+    }
+    else if (limit < arena.size())
+    {
+        num_of_records = 0;
+        sort_arena<Rec>(arena, m_sorting_order, pool, [&writer, &num_of_records, limit](const char *record)
+                        {
+                            if (num_of_records < limit)
+                            {
+                                writer.write(record);
+                                num_of_records++;
+                            } });
     }
     else
     {
-        // sort in descending order
-        sort(buffer.begin(), buffer.begin() + records_read, greater<Rec>());
+        sort_arena<Rec>(arena, m_sorting_order, pool, [&writer](const char *record)
+                        { writer.write(record); });
+    }
+    if (num_of_written)
+    {
+        *num_of_written = num_of_records;
+    }
+    if (m_counters)
+    {
+        // The blocks written while the records are handed over are counted as writing
+        m_counters->sort_ns += elapsed_ns(start) - writer.wait_ns();
     }
 
-    for (long cur_record_idx = i; cur_record_idx <= j; cur_record_idx++)
+    writer.flush();
+    if (writer.failed())
     {
-        WriteRecord(cur_record_idx, buffer[cur_record_idx - i]);
+        perror(-2);
+        return -1;
     }
 
     return 1;
 }
 
 /**
- * @brief Merges records within the specified range using the provided block sizes.
- * 
- * This method merges records within the specified range by reading them into a buffer, which employs a priority queue.
- * The buffer continuously pops the smallest or largest record (depending on the sorting order) and writes it to the output file
- * until all records within the range are merged.
- *
- * @param start_block The index of the starting block.
- * @param block_sizes Vector containing the sizes of individual blocks.
- * @param num_of_blocks_to_merge Number of blocks to merge.
- * @param start_record The index of the starting record.
- * @param end_record The index of the ending record.
- * @return An integer indicating the success of the merging operation (1 for success, -1 for failure).
+ * @brief Sorts the whole input file into runs using replacement selection.
+ *
+ * The memory holds a Buffer heap of records, each tagged with the run it belongs to. The top record is written to the
+ * current run and its slot is refilled with the next input record, which joins the current run if it does not come before
+ * the record just written, and the next run otherwise. On random input the runs are about twice the size of the memory,
+ * and input that is already sorted produces a single run.
+ * The runs take turns over the output files (see AddOutputFile), each starting at the index of its first record.
+ *
+ * @param runs Receives the runs written, in order, with the index of their output file.
+ * @return An integer indicating the success of the sorting operation (1 for success, -1 for failure).
  */
 template <typename Rec>
-int FileSorter<Rec>::TwoPassMergeSort(
-    size_t start_block,
-    vector<size_t> block_sizes,
-    size_t num_of_blocks_to_merge,
-    size_t start_record,
-    size_t end_record)
+int FileSorter<Rec>::ReplacementSelection(vector<RunSegment> &runs)
 {
-    if (num_of_blocks_to_merge == 0)
+    runs.clear();
+    size_t num_of_records = static_cast<size_t>(max(m_lnrecords, 0L));
+    size_t num_of_slots = min(GetBufferSize(), num_of_records);
+
+    // Half of the memory holds the records of the heap, the other half the reader and writer blocks
+    RecordArena arena(SIZE_OF_REC, num_of_slots);
+    if (!m_inputs[0]->LoadArena(arena, 0, num_of_slots))
     {
-        return 1;
+        perror(-2);
+        return -1;
     }
-    // If number of blocks need to be merged is 1
-    else if (num_of_blocks_to_merge == 1)
+    size_t num_of_outputs = m_outputs.size();
+    size_t io_block_size = GetIOBlockSize(2 * (num_of_outputs + 1));
+    RunReader reader = m_inputs[0]->OpenReader(num_of_slots, num_of_records, io_block_size);
+    vector<RunWriter> writers;
+    writers.reserve(num_of_outputs);
+    for (size_t k = 0; k < num_of_outputs; k++)
     {
-        // Writes all records from the block to the output file
-        for (size_t i = start_record; i < end_record; i++)
-        {
-            Rec record = ReadRecord(i);
-            WriteRecord(i, record);
-        }
-        return 1;
+        writers.push_back(m_outputs[k]->OpenWriter(0, io_block_size));
     }
 
-    Buffer<RecWithBlockIndex<Rec>> buffer(num_of_blocks_to_merge, m_sorting_order);
-
-    // Keeps track of the merged record index from each block
-    vector<size_t> current_block_record_indices(block_sizes.size(), 0);
-    size_t record_index = start_record;
+    Buffer<RecWithRunNumber<Rec>> buffer(max<size_t>(1, num_of_slots), m_sorting_order);
+    for (size_t k = 0; k < num_of_slots; k++)
+    {
+        RecWithRunNumber<Rec> r = {Rec(arena[k]), 0, key_prefix(arena[k])};
+        buffer.push(r);
+    }
 
-    // Populates the buffer with the first record on each block
-    for (size_t i = 0; i < num_of_blocks_to_merge; i++)
+    size_t current_run = 0;
+    RunSegment run = {0, 0, 0};
+    while (!buffer.empty())
     {
-        Rec record = ReadRecord(record_index);
-        RecWithBlockIndex<Rec> record_with_block_index = CreateRecWithBlockIndex(record, i + start_block);
-        current_block_record_indices[i + start_block]++;
+        RecWithRunNumber<Rec> r = buffer.top();
+        buffer.pop();
+        if (r.run != current_run)
+        {
+            runs.push_back(run);
+            current_run = r.run;
+            run.begin = run.end;
+            run.file = current_run % num_of_outputs;
+            writers[run.file].StartRun(run.begin);
+        }
+        writers[run.file].write(r.value.data());
+        run.end++;
 
-        if (!buffer.push(record_with_block_index))
+        if (reader.empty())
+        {
+            continue;
+        }
+
+        // Refills the slot of the written record, records that come before it have to wait for the next run
+        Rec next(reader.current());
+        bool before = m_sorting_order == 1 ? next < r.value : next > r.value;
+        char *slot = arena[(r.value.data() - arena[0]) / SIZE_OF_REC];
+        memcpy(slot, reader.current(), SIZE_OF_REC);
+        reader.advance();
+
+        RecWithRunNumber<Rec> refill = {Rec(slot), before ? current_run + 1 : current_run, key_prefix(slot)};
+        if (!buffer.push(refill))
         {
             perror(-3);
             return -1;
         }
-        record_index += block_sizes[i + start_block];
+    }
+    if (run.end > run.begin)
+    {
+        runs.push_back(run);
     }
 
-    size_t current_record = start_record;
+    bool failed = reader.failed();
+    for (size_t k = 0; k < num_of_outputs; k++)
+    {
+        writers[k].flush();
+        failed = failed || writers[k].failed();
+    }
+    if (failed)
+    {
+        perror(-2);
+        return -1;
+    }
 
-    // Merges all records within the specified range from the starting index to the end index
-    while (current_record < end_record && !buffer.empty())
+    return 1;
+}
+
+/**
+ * @brief Writes the first 'k' records of the input file in sorted order to the output file, in one pass over the input.
+ *
+ * The records kept fill an arena of at most 'k' records, which must fit in memory next to the blocks of the reader.
+ * The rest of the input is streamed through a TopKHeap, which replaces the last record kept whenever a record comes
+ * before it, and the records kept are sorted and written from the start of the output file.
+ *
+ * @param k The number of records to write, fewer if the input holds fewer.
+ * @return An integer indicating the success of the selection (1 for success, -1 for failure).
+ */
+template <typename Rec>
+int FileSorter<Rec>::TopK(size_t k)
+{
+    size_t num_of_records = static_cast<size_t>(max(m_lnrecords, 0L));
+    RecordArena kept(SIZE_OF_REC, min(k, num_of_records));
+    TopKHeap<Rec> heap(kept, m_sorting_order);
+
+    // The blocks of the reader and the writer share the half of the memory left by the records kept
+    RunReader reader = m_inputs[0]->OpenReader(0, num_of_records, GetIOBlockSize(4), m_io_pool);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    uint64_t read_ns = m_counters ? m_counters->read_ns.load() : 0;
+    while (!reader.empty())
     {
-        RecWithBlockIndex<Rec> r = buffer.top();
-        WriteRecord(current_record, r.value);
-        buffer.pop();
-        current_record++;
+        size_t n = reader.available();
+        const char *records = reader.current();
+        for (size_t i = 0; i < n; i++)
+        {
+            heap.Offer(records + i * SIZE_OF_REC);
+        }
+        reader.advance(n);
+    }
+    if (reader.failed())
+    {
+        perror(-2);
+        return -1;
+    }
 
-        // Gets the block index where the popped record belongs
-        size_t block_index = r.index;
-        size_t current_block_record_index = current_block_record_indices[block_index];
+    RunWriter writer = m_outputs[0]->OpenWriter(0, GetIOBlockSize(4));
+    sort_arena<Rec>(kept, m_sorting_order, nullptr, [&writer](const char *record)
+                    { writer.write(record); });
+    if (m_counters)
+    {
+        // The heap counts as sorting, the reads of the input as reading
+        m_counters->sort_ns += elapsed_ns(start) - (m_counters->read_ns - read_ns) - writer.wait_ns();
+    }
+    writer.flush();
+    if (writer.failed())
+    {
+        perror(-2);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Merges sorted record ranges into one sorted range of the output file by splitting them into key ranges merged in parallel.
+ *
+ * Splitter keys are sampled from the ranges, and each range is cut at the splitters by binary search.
+ * Every key range is then an independent merge of its pieces of the ranges, writing to its own disjoint
+ * part of the output, so the key ranges are merged concurrently on the thread pool.
+ *
+ * @param segments The sorted record ranges to merge.
+ * @param out_start The index in the output file where the merged records are written.
+ * @param pool The thread pool running the merges of the key ranges.
+ * @param out_file The index of the output file receiving the merged records, see AddOutputFile.
+ * @param num_of_written Receives the number of records written, or null.
+ * @return An integer indicating the success of the merging operation (1 for success, -1 for failure).
+ */
+template <typename Rec>
+int FileSorter<Rec>::PartitionedMergeSort(const vector<RunSegment> &segments, size_t out_start, ThreadPool &pool, size_t out_file,
+                                           size_t *num_of_written)
+{
+    size_t num_of_records = 0;
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        num_of_records += segments[i].end - segments[i].begin;
+    }
+    size_t num_of_partitions = min({pool.size(), num_of_records / MIN_PARTITION_SIZE, GetNumOfMerges(segments.size())});
+
+    // Compressed runs can neither be sampled nor written in pieces, so they are merged as a whole,
+    // and so are reduced or limited runs, whose pieces do not know where to write before the ones before them are merged
+    if (num_of_partitions <= 1 || segments.size() <= 1 || m_in_codec || m_out_codec || m_reducer || m_limit > 0)
+    {
+        return TwoPassMergeSort(segments, out_start, out_file, num_of_written);
+    }
+    if (num_of_written)
+    {
+        *num_of_written = num_of_records;
+    }
 
-        // If there are more records need to be merged from the block
-        if (current_block_record_index < block_sizes[block_index])
+    // Samples keys evenly from every range and takes the splitters at equal steps of the sorted sample
+    const size_t samples_per_block = 16 * num_of_partitions;
+    vector<char> samples;
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        size_t length = segments[i].end - segments[i].begin;
+        for (size_t k = 0; k < samples_per_block && k < length; k++)
         {
-            // Reads the next record from the same block and adds it to the buffer
-            size_t r_index = GetRecordIndex(start_block, block_index, block_sizes, start_record, current_block_record_index);
-            Rec record = ReadRecord(r_index);
-            RecWithBlockIndex<Rec> record_with_block_index = CreateRecWithBlockIndex(record, block_index);
-            if (!buffer.push(record_with_block_index))
+            size_t offset = samples.size();
+            samples.resize(offset + SIZE_OF_REC);
+            if (!m_inputs[segments[i].file]->ReadRecords(&samples[offset], segments[i].begin + k * length / samples_per_block, 1))
             {
-                perror(-3);
+                perror(-2);
                 return -1;
             }
-            current_block_record_indices[block_index]++;
         }
     }
+    vector<Rec> sample_keys;
+    for (size_t offset = 0; offset < samples.size(); offset += SIZE_OF_REC)
+    {
+        sample_keys.push_back(Rec(&samples[offset]));
+    }
+    if (m_sorting_order == 1)
+    {
+        sort(sample_keys.begin(), sample_keys.end());
+    }
+    else
+    {
+        sort(sample_keys.begin(), sample_keys.end(), greater<Rec>());
+    }
+
+    // Cuts every range at each splitter, the pieces between two splitters form one partition
+    vector<vector<RunSegment>> partitions(num_of_partitions, segments);
+    for (size_t p = 1; p < num_of_partitions; p++)
+    {
+        Rec splitter = sample_keys[p * sample_keys.size() / num_of_partitions];
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            size_t cut = LowerBound(segments[i], splitter);
+            partitions[p - 1][i].end = cut;
+            partitions[p][i].begin = cut;
+        }
+    }
+
+    // Merges the partitions concurrently, each writing right after the records of the previous partitions
+    size_t num_of_workers = m_num_of_workers;
+    SetNumOfWorkers(num_of_partitions);
+    vector<int> results(num_of_partitions, 1);
+    for (size_t p = 0; p < num_of_partitions; p++)
+    {
+        pool.submit([this, &partitions, &results, p, out_start, out_file]()
+                    { results[p] = TwoPassMergeSort(partitions[p], out_start, out_file); });
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            out_start += partitions[p][i].end - partitions[p][i].begin;
+        }
+    }
+    pool.wait();
+    SetNumOfWorkers(num_of_workers);
+
+    for (size_t p = 0; p < num_of_partitions; p++)
+    {
+        if (results[p] != 1)
+        {
+            return results[p];
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Finds the first record of a sorted range that does not come before the given key.
+ *
+ * The range is binary searched with one single-record read per step.
+ *
+ * @param segment The record range to search, sorted in the sorting order.
+ * @param key The record holding the key to search for.
+ * @return The index of the first record that does not come before the key, or the end of the range.
+ */
+template <typename Rec>
+size_t FileSorter<Rec>::LowerBound(const RunSegment &segment, const Rec &key)
+{
+    vector<char> record(SIZE_OF_REC);
+    size_t low = segment.begin;
+    size_t high = segment.end;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (!m_inputs[segment.file]->ReadRecords(record.data(), mid, 1))
+        {
+            perror(-2);
+            return high;
+        }
+        Rec value(record.data());
+        bool before = m_sorting_order == 1 ? value < key : value > key;
+        if (before)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Merges sorted record ranges of the input files into one sorted range of the output file.
+ *
+ * This method streams each range through a RunReader and merges them with a RunMerger, writing every record it
+ * picks to the output file until all records are merged. Records never leave the readers' blocks.
+ * With an I/O pool (see SetIOPool), the disk work of the readers and the writer overlaps the merge. The memory is split between the readers and the output RunWriter,
+ * so the disk only sees large sequential reads and writes. Compressed files are instead read and written one frame per block.
+ * With a reducer (see SetReducer), the ranges must be given in the order of the input, and only one record per key is written.
+ * With a limit (see SetLimit), the merge stops after its first records.
+ *
+ * @param segments The sorted record ranges to merge.
+ * @param out_start The index in the output file where the merged records are written.
+ * @param out_file The index of the output file receiving the merged records, see AddOutputFile.
+ * @param num_of_written Receives the number of records written, or null.
+ * @return An integer indicating the success of the merging operation (1 for success, -1 for failure).
+ */
+template <typename Rec>
+int FileSorter<Rec>::TwoPassMergeSort(const vector<RunSegment> &segments, size_t out_start, size_t out_file, size_t *num_of_written)
+{
+    size_t num_of_segments = segments.size();
+    size_t limit = m_limit > 0 ? m_limit : SIZE_MAX;
+    size_t num_of_records = 0;
+    for (size_t i = 0; i < num_of_segments; i++)
+    {
+        num_of_records += segments[i].end - segments[i].begin;
+    }
+    num_of_records = min(num_of_records, limit);
+    if (num_of_written)
+    {
+        *num_of_written = num_of_records;
+    }
+    if (num_of_segments == 0)
+    {
+        return 1;
+    }
+
+    // Splits the memory between one reader per range and the writer, each with two blocks when the I/O is asynchronous
+    size_t num_of_blocks = (num_of_segments + 1) * (m_io_pool ? 2 : 1);
+    size_t io_block_size = GetIOBlockSize(num_of_blocks);
+    RunWriter writer = m_outputs[out_file]->OpenWriter(out_start, io_block_size, m_io_pool);
+
+    // If number of ranges need to be merged is 1
+    if (num_of_segments == 1)
+    {
+        // Copies the range to the output file a whole block at a time, a run having no equal keys left to reduce
+        RunReader reader = m_inputs[segments[0].file]->OpenReader(segments[0].begin, segments[0].begin + num_of_records, io_block_size, m_io_pool);
+        while (!reader.empty())
+        {
+            size_t n = reader.available();
+            writer.write(reader.current(), n);
+            reader.advance(n);
+        }
+        writer.flush();
+        if (reader.failed() || writer.failed())
+        {
+            perror(-2);
+            return -1;
+        }
+        return 1;
+    }
+
+    // Streams each range through its own reader and merges all their records
+    vector<RunReader> readers;
+    readers.reserve(num_of_segments);
+    for (size_t i = 0; i < num_of_segments; i++)
+    {
+        readers.push_back(m_inputs[segments[i].file]->OpenReader(segments[i].begin, segments[i].end, io_block_size, m_io_pool));
+    }
+    RunMerger merger(move(readers), m_sorting_order);
+    if (m_reducer)
+    {
+        // The merge is stable, so the records of a key come in the order of the ranges
+        ReduceStream stream(*m_reducer, SIZE_OF_REC, false);
+        num_of_records = 0;
+        for (; !merger.empty() && num_of_records < limit; merger.advance())
+        {
+            if (const char *reduced = stream.Add(merger.current()))
+            {
+                writer.write(reduced);
+                num_of_records++;
+            }
+        }
+        const char *reduced = stream.Flush();
+        if (reduced && num_of_records < limit)
+        {
+            writer.write(reduced);
+            num_of_records++;
+        }
+        if (num_of_written)
+        {
+            *num_of_written = num_of_records;
+        }
+    }
+    else
+    {
+        for (size_t n = 0; n < num_of_records && !merger.empty(); n++, merger.advance())
+        {
+            writer.write(merger.current());
+        }
+    }
+    if (m_counters)
+    {
+        m_counters->comparisons += merger.comparisons();
+    }
+
+    writer.flush();
+    if (merger.failed() || writer.failed())
+    {
+        perror(-2);
+        return -1;
+    }
 
     return 1;
 }
@@ -381,6 +1042,17 @@ long FileSorter<Rec>::GetNumRecords()
     return m_lnrecords;
 }
 
+/**
+ * @brief Checks if the files are read and written through memory mappings.
+ *
+ * @return True if the files are mapped, false if they are streamed.
+ */
+template <typename Rec>
+bool FileSorter<Rec>::IsMapped()
+{
+    return m_inputs[0]->IsMapped();
+}
+
 /**
  * @brief Prints an error message based on the provided error code.
  *
@@ -392,6 +1064,12 @@ long FileSorter<Rec>::GetNumRecords()
  * -2: "File IO error."
  * -3: "Buffer is full."
  * -4: "Sorting failed."
+ * -5: "Input size is not a multiple of the record size."
+ * -6: "Input lines do not match the record size."
+ * -7: "Invalid key specification."
+ * -8: "Invalid unique or combine specification."
+ * -9: "Input line is too long."
+ * -10: "Option not supported with --variable-length."
  * Default: "Unknown error code: x" (where 'x' is the provided error code)
  *
  * @param x The error code indicating the type of error.
@@ -414,6 +1092,24 @@ void FileSorter<Rec>::perror(int x)
     case -4:
         cout << "Sorting failed." << endl;
         break;
+    case -5:
+        cout << "Input size is not a multiple of the record size." << endl;
+        break;
+    case -6:
+        cout << "Input lines do not match the record size." << endl;
+        break;
+    case -7:
+        cout << "Invalid key specification." << endl;
+        break;
+    case -8:
+        cout << "Invalid unique or combine specification." << endl;
+        break;
+    case -9:
+        cout << "Input line is too long." << endl;
+        break;
+    case -10:
+        cout << "Option not supported with --variable-length." << endl;
+        break;
     default:
         cout << "Unknown error code: " << x << endl;
     }
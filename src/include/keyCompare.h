@@ -0,0 +1,141 @@
+#ifndef KEYCOMPARE_H
+#define KEYCOMPARE_H
+
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+/**
+ * @brief A function comparing the keys of two raw records in unsigned byte order.
+ *
+ * Returns a negative value if the first key is smaller, zero if they are equal and a positive value otherwise.
+ */
+typedef int (*KeyCompareFn)(const char *k1, const char *k2);
+
+extern thread_local long KEY_SIZE;
+
+/**
+ * @brief Loads 8 bytes as a big-endian integer, so integer order is the unsigned byte order.
+ *
+ * @param p A pointer to the bytes.
+ * @return The bytes as a big-endian 64-bit integer.
+ */
+inline uint64_t load_be64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/**
+ * @brief Loads 2 bytes as a big-endian integer.
+ *
+ * @param p A pointer to the bytes.
+ * @return The bytes as a big-endian 16-bit integer.
+ */
+inline uint16_t load_be16(const char *p)
+{
+    return static_cast<uint16_t>((static_cast<unsigned char>(p[0]) << 8) | static_cast<unsigned char>(p[1]));
+}
+
+/**
+ * @brief Compares two integers three-way.
+ */
+template <typename T>
+inline int compare_values(T a, T b)
+{
+    return (a > b) - (a < b);
+}
+
+/**
+ * @brief Compares keys of a width known at compile time.
+ *
+ * Widths without a specialization use memcmp, which compares in unsigned byte order.
+ */
+template <long N>
+inline int compare_fixed_keys(const char *k1, const char *k2)
+{
+    return memcmp(k1, k2, N);
+}
+
+template <>
+inline int compare_fixed_keys<8>(const char *k1, const char *k2)
+{
+    return compare_values(load_be64(k1), load_be64(k2));
+}
+
+template <>
+inline int compare_fixed_keys<10>(const char *k1, const char *k2)
+{
+    uint64_t a = load_be64(k1);
+    uint64_t b = load_be64(k2);
+    if (a != b)
+    {
+        return compare_values(a, b);
+    }
+    return compare_values(load_be16(k1 + 8), load_be16(k2 + 8));
+}
+
+template <>
+inline int compare_fixed_keys<16>(const char *k1, const char *k2)
+{
+    uint64_t a = load_be64(k1);
+    uint64_t b = load_be64(k2);
+    if (a != b)
+    {
+        return compare_values(a, b);
+    }
+    return compare_values(load_be64(k1 + 8), load_be64(k2 + 8));
+}
+
+template <>
+inline int compare_fixed_keys<32>(const char *k1, const char *k2)
+{
+    for (long i = 0; i < 32; i += 8)
+    {
+        uint64_t a = load_be64(k1 + i);
+        uint64_t b = load_be64(k2 + i);
+        if (a != b)
+        {
+            return compare_values(a, b);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Compares keys of the runtime width KEY_SIZE with memcmp.
+ */
+inline int compare_runtime_keys(const char *k1, const char *k2)
+{
+    return memcmp(k1, k2, KEY_SIZE);
+}
+
+/**
+ * @brief Selects the key comparison for a key width, to be called once at startup.
+ *
+ * @param key_size The width of the keys in bytes.
+ * @return The specialized comparison for 8, 10, 16 and 32-byte keys, or the memcmp comparison for other widths.
+ */
+inline KeyCompareFn select_key_compare(long key_size)
+{
+    switch (key_size)
+    {
+    case 8:
+        return compare_fixed_keys<8>;
+    case 10:
+        return compare_fixed_keys<10>;
+    case 16:
+        return compare_fixed_keys<16>;
+    case 32:
+        return compare_fixed_keys<32>;
+    default:
+        return compare_runtime_keys;
+    }
+}
+
+#endif
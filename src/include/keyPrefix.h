@@ -0,0 +1,103 @@
+#ifndef KEYPREFIX_H
+#define KEYPREFIX_H
+
+#include <cstdint>
+#include <record.h>
+#include <recordArena.h>
+
+using namespace std;
+
+extern thread_local long KEY_SIZE;
+extern thread_local long SIZE_OF_REC;
+
+// Number of key bytes cached in a KeyPrefixEntry
+const long KEY_PREFIX_SIZE = sizeof(uint64_t);
+
+// Records at least this wide are sorted through key-prefix entries even when the key is longer than the prefix,
+// since every comparison of views would otherwise touch a different cache line
+const long KEY_PREFIX_MIN_REC_SIZE = 64;
+
+/**
+ * @brief A compact sort entry made of a normalized key prefix and the index of the record in its arena.
+ *
+ * The index is as wide as the prefix, which the entry is padded to anyway, so arenas of more than 2^32 records
+ * are indexed too.
+ */
+struct KeyPrefixEntry
+{
+    uint64_t prefix;
+    size_t index;
+};
+
+/**
+ * @brief Builds the normalized prefix of a record's key.
+ *
+ * The first KEY_PREFIX_SIZE bytes of the key are packed big-endian, so that comparing two prefixes
+ * as unsigned integers gives the same order as comparing the keys byte by byte.
+ * Keys shorter than the prefix are padded with zeros.
+ *
+ * @param record A pointer to the raw data of the record.
+ * @return The normalized key prefix.
+ */
+inline uint64_t key_prefix(const char *record)
+{
+    if (KEY_SIZE >= KEY_PREFIX_SIZE)
+    {
+        return load_be64(record);
+    }
+    uint64_t prefix = 0;
+    for (long i = 0; i < KEY_SIZE; i++)
+    {
+        prefix = (prefix << 8) | static_cast<unsigned char>(record[i]);
+    }
+    return prefix << (8 * (KEY_PREFIX_SIZE - KEY_SIZE));
+}
+
+/**
+ * @brief Decides if pass 0 should sort key-prefix entries instead of record views.
+ *
+ * Prefix entries are used when the prefix holds the whole key, or when records are wide enough
+ * that comparing through views would miss the cache on nearly every comparison.
+ *
+ * @return True if key-prefix entries should be sorted, otherwise false.
+ */
+inline bool use_key_prefix_sort()
+{
+    return KEY_SIZE <= KEY_PREFIX_SIZE || SIZE_OF_REC >= KEY_PREFIX_MIN_REC_SIZE;
+}
+
+/**
+ * @brief Orders key-prefix entries by their prefix, falling back to the full keys in the arena on ties.
+ */
+struct KeyPrefixLess
+{
+    const RecordArena *arena;
+
+    bool operator()(const KeyPrefixEntry &e1, const KeyPrefixEntry &e2) const
+    {
+        if (e1.prefix != e2.prefix)
+        {
+            return e1.prefix < e2.prefix;
+        }
+        return KEY_SIZE > KEY_PREFIX_SIZE && compare_keys((*arena)[e1.index], (*arena)[e2.index]) < 0;
+    }
+};
+
+/**
+ * @brief Orders key-prefix entries in descending order of their keys.
+ */
+struct KeyPrefixGreater
+{
+    const RecordArena *arena;
+
+    bool operator()(const KeyPrefixEntry &e1, const KeyPrefixEntry &e2) const
+    {
+        if (e1.prefix != e2.prefix)
+        {
+            return e1.prefix > e2.prefix;
+        }
+        return KEY_SIZE > KEY_PREFIX_SIZE && compare_keys((*arena)[e1.index], (*arena)[e2.index]) > 0;
+    }
+};
+
+#endif
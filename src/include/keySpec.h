@@ -0,0 +1,231 @@
+#ifndef KEYSPEC_H
+#define KEYSPEC_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @brief The types of the fields of a key, each normalized so that its bytes compare in the order of its values.
+ */
+enum KeyFieldType
+{
+    KEY_BYTES, // Raw bytes, compared in unsigned byte order
+    KEY_UINT,  // Unsigned integer of 1, 2, 4 or 8 bytes
+    KEY_INT,   // Two's complement integer of 1, 2, 4 or 8 bytes
+    KEY_FLOAT  // IEEE 754 float of 4 or 8 bytes
+};
+
+/**
+ * @brief One field of a key: where it is in the record, and how its bytes are normalized.
+ */
+struct KeyField
+{
+    size_t offset;
+    size_t length;
+    KeyFieldType type;
+    bool little_endian;
+    bool descending;
+};
+
+/**
+ * @brief A key made of fields anywhere in the record, compiled into a normalized binary key.
+ *
+ * A spec is a comma-separated list of fields 'offset:length[:type][:desc]', where the type is 'bytes' (the default),
+ * 'u8', 'i8', or 'u16', 'u32', 'u64', 'i16', 'i32', 'i64', 'f32', 'f64' followed by 'le' or 'be', e.g.
+ * "16:8:u64le,0:4:i32be:desc". Each field is normalized to big-endian bytes that compare, as unsigned bytes,
+ * in the order of the field's values: integers get their sign bit flipped, floats also all their other bits when
+ * negative, and descending fields are complemented. The normalized fields are concatenated in the order of the spec,
+ * so the whole key sorts with the usual byte comparisons.
+ */
+class KeySpec
+{
+    vector<KeyField> m_fields;
+    size_t m_size; // Size of the normalized key
+
+public:
+    KeySpec() : m_size(0) {}
+
+    /**
+     * @brief Parses the type of a field, checking it against the length of the field.
+     *
+     * @param name The type, e.g. "bytes" or "u32le".
+     * @param field The field, whose length is set, receiving the type and byte order.
+     * @return True if the type is known and fits the length, otherwise false.
+     */
+    static bool ParseType(const string &name, KeyField &field)
+    {
+        if (name == "bytes")
+        {
+            field.type = KEY_BYTES;
+            return true;
+        }
+        if (name.size() < 2 || (name[0] != 'u' && name[0] != 'i' && name[0] != 'f'))
+        {
+            return false;
+        }
+        field.type = name[0] == 'u' ? KEY_UINT : (name[0] == 'i' ? KEY_INT : KEY_FLOAT);
+        string bits = name.substr(1);
+        field.little_endian = false;
+        if (bits.size() > 2 && (bits.compare(bits.size() - 2, 2, "le") == 0 || bits.compare(bits.size() - 2, 2, "be") == 0))
+        {
+            field.little_endian = bits[bits.size() - 2] == 'l';
+            bits.resize(bits.size() - 2);
+        }
+        else if (bits != "8")
+        {
+            return false; // Only single bytes have no byte order
+        }
+        if (bits != "8" && bits != "16" && bits != "32" && bits != "64")
+        {
+            return false;
+        }
+        size_t width = atoi(bits.c_str()) / 8;
+        if (field.type == KEY_FLOAT && width != 4 && width != 8)
+        {
+            return false;
+        }
+        return field.length == width;
+    }
+
+    /**
+     * @brief Compiles a key spec.
+     *
+     * @param text The spec, see the class description.
+     * @param rec_size The size of the records, which every field must fit in.
+     * @param spec Receives the compiled spec.
+     * @return True if the spec is valid, otherwise false.
+     */
+    static bool Parse(const string &text, size_t rec_size, KeySpec &spec)
+    {
+        spec.m_fields.clear();
+        spec.m_size = 0;
+        for (size_t start = 0; start <= text.size();)
+        {
+            size_t end = text.find(',', start);
+            if (end == string::npos)
+            {
+                end = text.size();
+            }
+            vector<string> parts;
+            for (size_t p = start; p <= end;)
+            {
+                size_t colon = text.find(':', p);
+                if (colon == string::npos || colon > end)
+                {
+                    colon = end;
+                }
+                parts.push_back(text.substr(p, colon - p));
+                p = colon + 1;
+            }
+            start = end + 1;
+
+            KeyField field = {0, 0, KEY_BYTES, false, false};
+            if (parts.size() < 2 || parts.size() > 4 || parts[0].empty() || parts[1].empty() ||
+                parts[0].find_first_not_of("0123456789") != string::npos || parts[1].find_first_not_of("0123456789") != string::npos)
+            {
+                return false;
+            }
+            field.offset = strtoul(parts[0].c_str(), nullptr, 10);
+            field.length = strtoul(parts[1].c_str(), nullptr, 10);
+            if (parts.size() == 4 && parts[3] != "desc")
+            {
+                return false;
+            }
+            field.descending = parts.size() == 4 || (parts.size() == 3 && parts[2] == "desc");
+            string type = parts.size() == 4 || (parts.size() == 3 && !field.descending) ? parts[2] : "bytes";
+            if (field.length == 0 || field.offset + field.length > rec_size || !ParseType(type, field))
+            {
+                return false;
+            }
+            spec.m_fields.push_back(field);
+            spec.m_size += field.length;
+        }
+        return !spec.m_fields.empty();
+    }
+
+    /**
+     * @brief Checks if the spec has no fields, i.e. the key is the start of the record.
+     */
+    bool empty() const
+    {
+        return m_fields.empty();
+    }
+
+    /**
+     * @brief Checks if a field of the spec covers any of the bytes [offset, offset + length) of the record.
+     */
+    bool Overlaps(size_t offset, size_t length) const
+    {
+        for (size_t i = 0; i < m_fields.size(); i++)
+        {
+            if (offset < m_fields[i].offset + m_fields[i].length && m_fields[i].offset < offset + length)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Returns the size of the normalized key in bytes.
+     */
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * @brief Writes the normalized key of a record.
+     *
+     * @param record A pointer to the raw data of the record.
+     * @param key The destination of the key, size() bytes long.
+     */
+    void Normalize(const char *record, char *key) const
+    {
+        for (size_t i = 0; i < m_fields.size(); i++)
+        {
+            const KeyField &field = m_fields[i];
+            const unsigned char *src = reinterpret_cast<const unsigned char *>(record + field.offset);
+            unsigned char *dst = reinterpret_cast<unsigned char *>(key);
+            if (field.type == KEY_BYTES)
+            {
+                memcpy(dst, src, field.length);
+            }
+            else
+            {
+                // Big-endian, then the sign bit flipped, and for negative floats every other bit too
+                for (size_t b = 0; b < field.length; b++)
+                {
+                    dst[b] = field.little_endian ? src[field.length - 1 - b] : src[b];
+                }
+                bool negative = (dst[0] & 0x80) != 0;
+                if (field.type == KEY_FLOAT && negative)
+                {
+                    for (size_t b = 0; b < field.length; b++)
+                    {
+                        dst[b] = ~dst[b];
+                    }
+                }
+                else if (field.type != KEY_UINT)
+                {
+                    dst[0] ^= 0x80;
+                }
+            }
+            if (field.descending)
+            {
+                for (size_t b = 0; b < field.length; b++)
+                {
+                    dst[b] = ~dst[b];
+                }
+            }
+            key += field.length;
+        }
+    }
+};
+
+#endif
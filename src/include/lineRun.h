@@ -0,0 +1,356 @@
+#ifndef LINERUN_H
+#define LINERUN_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <runIO.h>
+
+using namespace std;
+
+/**
+ * Variable-length records are newline-terminated lines of up to MAX_LINE_LENGTH bytes. Pass 0 keeps the lines of a
+ * run once, back to back in a byte buffer, and sorts a compact index of them. Run files store each line once, after its
+ * length, so that the merges read and write about as many bytes as the input holds.
+ */
+
+// Size of the length stored before every line of a run file
+const size_t LINE_LENGTH_SIZE = sizeof(uint32_t);
+
+// Longest line that its stored length can describe
+const size_t MAX_LINE_LENGTH = UINT32_MAX;
+
+/**
+ * @brief A sort entry of a line: the normalized prefix of its key, and where the line is in its buffer.
+ */
+struct LineEntry
+{
+    uint64_t prefix;
+    uint64_t offset;
+    uint32_t length; // Length of the line without its newline
+};
+
+/**
+ * @brief Builds the normalized prefix of a line's key, like key_prefix() for fixed-size records.
+ *
+ * The key is the first 'key_size' bytes of the line, or the whole line when it is shorter, padded with zeros.
+ *
+ * @param line A pointer to the line.
+ * @param length The length of the line.
+ * @param key_size The size of the keys.
+ * @return The normalized key prefix.
+ */
+inline uint64_t line_prefix(const char *line, size_t length, long key_size)
+{
+    size_t n = min<size_t>(min<size_t>(length, key_size), sizeof(uint64_t));
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        prefix = (prefix << 8) | static_cast<unsigned char>(line[i]);
+    }
+    return n == 0 ? 0 : prefix << (8 * (sizeof(uint64_t) - n));
+}
+
+/**
+ * @brief Compares the keys of two lines in unsigned byte order.
+ *
+ * A key shorter than 'key_size', because its line is, comes before the longer keys it is a prefix of.
+ *
+ * @param l1 A pointer to the first line.
+ * @param n1 The length of the first line.
+ * @param l2 A pointer to the second line.
+ * @param n2 The length of the second line.
+ * @param key_size The size of the keys.
+ * @return A negative value if the first key is smaller, zero if they are equal and a positive value otherwise.
+ */
+inline int compare_lines(const char *l1, size_t n1, const char *l2, size_t n2, long key_size)
+{
+    size_t k1 = min<size_t>(n1, key_size);
+    size_t k2 = min<size_t>(n2, key_size);
+    int cmp = memcmp(l1, l2, min(k1, k2));
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return k1 < k2 ? -1 : (k1 > k2 ? 1 : 0);
+}
+
+/**
+ * @brief Orders line entries by their prefix, falling back to the keys in the buffer on ties.
+ */
+struct LineEntryPrecedes
+{
+    const char *buffer;
+    long key_size;
+    int sorting_order;
+
+    bool operator()(const LineEntry &e1, const LineEntry &e2) const
+    {
+        if (e1.prefix != e2.prefix)
+        {
+            return sorting_order == 1 ? e1.prefix < e2.prefix : e1.prefix > e2.prefix;
+        }
+        if (key_size <= static_cast<long>(sizeof(uint64_t)) && min<long>(e1.length, key_size) == min<long>(e2.length, key_size))
+        {
+            return false;
+        }
+        int cmp = compare_lines(buffer + e1.offset, e1.length, buffer + e2.offset, e2.length, key_size);
+        return sorting_order == 1 ? cmp < 0 : cmp > 0;
+    }
+};
+
+/**
+ * @brief Writes lines in large blocks, either length-framed at a byte offset of a run file or newline-terminated
+ * to a stream.
+ */
+class LineWriter
+{
+    int m_fd;         // Run file, when writing a run
+    FILE *m_stream;   // Output stream, when writing the sorted lines
+    size_t m_offset;  // Byte offset of the next block in the run file
+    vector<char> m_block;
+    size_t m_used;
+    bool m_failed;
+
+    /**
+     * @brief Writes out the buffered bytes.
+     */
+    void WriteBlock()
+    {
+        if (m_used == 0 || m_failed)
+        {
+            return;
+        }
+        if (m_stream)
+        {
+            m_failed = fwrite(m_block.data(), 1, m_used, m_stream) != m_used;
+        }
+        else
+        {
+            m_failed = !write_fully(m_fd, m_block.data(), m_used, m_offset);
+        }
+        m_offset += m_used;
+        m_used = 0;
+    }
+
+    /**
+     * @brief Appends bytes to the block, writing it out as it fills.
+     */
+    void Append(const char *data, size_t n)
+    {
+        while (n > 0)
+        {
+            size_t k = min(n, m_block.size() - m_used);
+            memcpy(m_block.data() + m_used, data, k);
+            m_used += k;
+            data += k;
+            n -= k;
+            if (m_used == m_block.size())
+            {
+                WriteBlock();
+            }
+        }
+    }
+
+public:
+    /**
+     * @brief Creates a writer of length-framed lines into a run file, from byte offset 'offset'.
+     */
+    LineWriter(int fd, size_t offset, size_t block_size)
+        : m_fd(fd), m_stream(nullptr), m_offset(offset), m_block(max<size_t>(block_size, LINE_LENGTH_SIZE)), m_used(0), m_failed(false) {}
+
+    /**
+     * @brief Creates a writer of newline-terminated lines into a stream.
+     */
+    LineWriter(FILE *stream, size_t block_size)
+        : m_fd(-1), m_stream(stream), m_offset(0), m_block(max<size_t>(block_size, 1)), m_used(0), m_failed(false) {}
+
+    /**
+     * @brief Writes one line, given without its newline.
+     *
+     * @param line A pointer to the line.
+     * @param length The length of the line.
+     */
+    void write(const char *line, uint32_t length)
+    {
+        if (m_stream)
+        {
+            Append(line, length);
+            Append("\n", 1);
+        }
+        else
+        {
+            char header[LINE_LENGTH_SIZE];
+            memcpy(header, &length, LINE_LENGTH_SIZE);
+            Append(header, LINE_LENGTH_SIZE);
+            Append(line, length);
+        }
+    }
+
+    /**
+     * @brief Writes out the lines still buffered.
+     */
+    void flush()
+    {
+        WriteBlock();
+        if (m_stream && !m_failed)
+        {
+            m_failed = fflush(m_stream) != 0;
+        }
+    }
+
+    /**
+     * @brief Checks if a write failed.
+     *
+     * @return True if a write failed, otherwise false.
+     */
+    bool failed() const
+    {
+        return m_failed;
+    }
+};
+
+/**
+ * @brief Reads the length-framed lines stored in the bytes [begin, end) of a run file, one block at a time.
+ *
+ * A line cut by the end of a block is moved to the front of the buffer before the next block is read after it,
+ * and the buffer grows for lines longer than a block.
+ */
+class LineReader
+{
+    int m_fd;
+    size_t m_next;  // Byte offset of the next block in the file
+    size_t m_end;   // Byte offset of the end of the run
+    vector<char> m_block;
+    size_t m_pos;   // Offset of the current line in the block, after its length
+    size_t m_avail; // Number of bytes read into the block
+    uint32_t m_length;
+    bool m_empty;
+    bool m_failed;
+
+    /**
+     * @brief Makes sure that 'n' bytes from m_pos are in the block, reading more of the run when needed.
+     *
+     * @return True if they are, false at the end of the run or on a read error.
+     */
+    bool Ensure(size_t n)
+    {
+        if (m_avail - m_pos >= n)
+        {
+            return true;
+        }
+        size_t left = m_avail - m_pos;
+        memmove(m_block.data(), m_block.data() + m_pos, left);
+        m_pos = 0;
+        m_avail = left;
+        if (m_block.size() < n)
+        {
+            m_block.resize(n);
+        }
+        size_t k = min(m_block.size() - m_avail, m_end - m_next);
+        if (k > 0 && !read_fully(m_fd, m_block.data() + m_avail, k, m_next))
+        {
+            m_failed = true;
+            return false;
+        }
+        m_next += k;
+        m_avail += k;
+        if (m_avail < n && left + k > 0)
+        {
+            m_failed = true; // The run ends inside a line
+        }
+        return m_avail >= n;
+    }
+
+public:
+    LineReader(int fd, size_t begin, size_t end, size_t block_size)
+        : m_fd(fd), m_next(begin), m_end(end), m_block(max<size_t>(block_size, LINE_LENGTH_SIZE)), m_pos(0), m_avail(0),
+          m_length(0), m_empty(false), m_failed(false)
+    {
+        advance();
+    }
+
+    /**
+     * @brief Moves to the next line of the run.
+     */
+    void advance()
+    {
+        m_pos += m_length;
+        m_length = 0;
+        if (!Ensure(LINE_LENGTH_SIZE))
+        {
+            m_empty = true;
+            return;
+        }
+        memcpy(&m_length, m_block.data() + m_pos, LINE_LENGTH_SIZE);
+        m_pos += LINE_LENGTH_SIZE;
+        if (!Ensure(m_length))
+        {
+            m_failed = true;
+            m_empty = true;
+            m_length = 0;
+        }
+    }
+
+    /**
+     * @brief Checks if every line of the run was read.
+     */
+    bool empty() const
+    {
+        return m_empty;
+    }
+
+    /**
+     * @brief Checks if a read failed or the run was cut.
+     */
+    bool failed() const
+    {
+        return m_failed;
+    }
+
+    /**
+     * @brief Returns the current line, valid until the next call to advance().
+     */
+    const char *data() const
+    {
+        return m_block.data() + m_pos;
+    }
+
+    /**
+     * @brief Returns the length of the current line.
+     */
+    uint32_t length() const
+    {
+        return m_length;
+    }
+};
+
+/**
+ * @brief Orders line readers by their current lines for a LoserTree, exhausted readers last and ties by index.
+ */
+struct LineReaderPrecedes
+{
+    const vector<LineReader> *readers;
+    long key_size;
+    int sorting_order;
+
+    bool operator()(size_t a, size_t b) const
+    {
+        const LineReader &ra = (*readers)[a];
+        const LineReader &rb = (*readers)[b];
+        if (ra.empty() || rb.empty())
+        {
+            return !ra.empty() || (rb.empty() && a < b);
+        }
+        int cmp = compare_lines(ra.data(), ra.length(), rb.data(), rb.length(), key_size);
+        if (cmp != 0)
+        {
+            return sorting_order == 1 ? cmp < 0 : cmp > 0;
+        }
+        return a < b;
+    }
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef LOSERTREE_H
+#define LOSERTREE_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * @brief A tournament tree of losers for merging k sorted sources.
+ *
+ * The tree only holds source indices; the records stay in the buffers of their sources.
+ * 'Precedes' is called as precedes(a, b) and must return true if the current record of source 'a'
+ * comes before the current record of source 'b'. Exhausted sources must come after all others.
+ * Once the current record of the winner is consumed and its source advanced, replay() finds the
+ * next winner with one comparison per level, about log2(k) comparisons per record.
+ */
+template <typename Precedes>
+class LoserTree
+{
+    size_t m_k;
+    vector<size_t> m_tree; // m_tree[0] is the winner, m_tree[1..k-1] the loser of each match
+    Precedes m_precedes;
+    uint64_t m_comparisons; // Matches played so far
+
+public:
+    LoserTree(size_t k, Precedes precedes) : m_k(max<size_t>(1, k)), m_tree(m_k), m_precedes(precedes), m_comparisons(m_k - 1)
+    {
+        // Plays all matches bottom-up, leaves k..2k-1 are the sources
+        vector<size_t> winners(2 * m_k);
+        for (size_t i = 0; i < m_k; i++)
+        {
+            winners[m_k + i] = i;
+        }
+        for (size_t n = m_k - 1; n >= 1; n--)
+        {
+            size_t a = winners[2 * n];
+            size_t b = winners[2 * n + 1];
+            if (m_precedes(b, a))
+            {
+                winners[n] = b;
+                m_tree[n] = a;
+            }
+            else
+            {
+                winners[n] = a;
+                m_tree[n] = b;
+            }
+        }
+        m_tree[0] = winners[1];
+    }
+
+    /**
+     * @brief Returns the index of the source holding the next record.
+     *
+     * @return The index of the winning source.
+     */
+    size_t winner() const
+    {
+        return m_tree[0];
+    }
+
+    /**
+     * @brief Replays the matches on the path of the winner after its source has advanced.
+     */
+    void replay()
+    {
+        size_t winner = m_tree[0];
+        for (size_t n = (winner + m_k) / 2; n >= 1; n /= 2)
+        {
+            m_comparisons++;
+            if (m_precedes(m_tree[n], winner))
+            {
+                swap(m_tree[n], winner);
+            }
+        }
+        m_tree[0] = winner;
+    }
+
+    /**
+     * @brief Returns the number of matches played, i.e. of calls to 'Precedes', since the tree was built.
+     */
+    uint64_t comparisons() const
+    {
+        return m_comparisons;
+    }
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef OFFSETVALUECODE_H
+#define OFFSETVALUECODE_H
+
+#include <cstdint>
+#include <keyCompare.h>
+
+using namespace std;
+
+/**
+ * Offset-value codes describe a key by how it differs from a base key that comes before it in the sorting order:
+ * the offset of the first byte where they differ, and the value of that byte. For keys coded against the same base,
+ * the code with the larger offset, or the same offset and a smaller value, belongs to the key that comes first,
+ * so most comparisons of a merge become a single integer compare. Keys whose codes are equal agree up to and
+ * including the coded byte, so only the bytes after it need to be compared.
+ */
+
+// Code of a source without records, which comes after every key
+const uint64_t OVC_EXHAUSTED = UINT64_MAX;
+
+/**
+ * @brief Finds the first byte where two keys differ, starting from a byte known to be equal before it.
+ *
+ * @param k1 A pointer to the first record.
+ * @param k2 A pointer to the second record.
+ * @param start The offset to start comparing at.
+ * @param key_size The size of the keys.
+ * @return The offset of the first differing byte, or 'key_size' if the keys are equal.
+ */
+inline long key_mismatch(const char *k1, const char *k2, long start, long key_size)
+{
+    long i = start;
+    for (; i + 8 <= key_size; i += 8)
+    {
+        uint64_t a = load_be64(k1 + i);
+        uint64_t b = load_be64(k2 + i);
+        if (a != b)
+        {
+            return i + (__builtin_clzll(a ^ b) >> 3);
+        }
+    }
+    for (; i < key_size; i++)
+    {
+        if (k1[i] != k2[i])
+        {
+            return i;
+        }
+    }
+    return key_size;
+}
+
+/**
+ * @brief Builds the offset-value code of a record's key against a base key it first differs from at 'offset'.
+ *
+ * Smaller codes come first in both sorting orders: the byte value is complemented for descending order,
+ * where keys differing from the base at a larger value come first. A key equal to its base is coded 0.
+ *
+ * @param record A pointer to the raw data of the record.
+ * @param offset The offset of the first byte where the key differs from the base, or 'key_size' if it does not.
+ * @param key_size The size of the keys.
+ * @param sorting_order The sorting order (1 for ascending, 0 for descending).
+ * @return The offset-value code.
+ */
+inline uint64_t ovc_make(const char *record, long offset, long key_size, int sorting_order)
+{
+    if (offset >= key_size)
+    {
+        return 0;
+    }
+    unsigned char value = static_cast<unsigned char>(record[offset]);
+    return (static_cast<uint64_t>(key_size - offset) << 8) | (sorting_order == 1 ? value : 255 - value);
+}
+
+/**
+ * @brief Returns the offset coded by a nonzero offset-value code.
+ */
+inline long ovc_offset(uint64_t code, long key_size)
+{
+    return key_size - static_cast<long>(code >> 8);
+}
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <keyPrefix.h>
+#include <threadPool.h>
+
+using namespace std;
+
+// Buckets smaller than this are sorted by comparison instead of another radix pass
+const size_t RADIX_SORT_MIN_BUCKET = 64;
+
+// Runs smaller than this are sorted by comparison only
+const size_t RADIX_SORT_MIN_SIZE = 4096;
+
+/**
+ * @brief Returns the radix digit of an entry at the given byte of its key prefix.
+ *
+ * @param entry The key-prefix entry.
+ * @param byte The index of the prefix byte, 0 being the most significant.
+ * @param descending Whether buckets are ordered from the largest digit down.
+ * @return The digit, in bucket order.
+ */
+inline size_t radix_digit(const KeyPrefixEntry &entry, size_t byte, bool descending)
+{
+    size_t digit = (entry.prefix >> (8 * (KEY_PREFIX_SIZE - 1 - byte))) & 0xFF;
+    return descending ? 255 - digit : digit;
+}
+
+/**
+ * @brief Sorts key-prefix entries with an in-place MSD radix sort on the bytes of their prefixes.
+ *
+ * Each pass distributes the entries into 256 buckets by one prefix byte (American flag sort), then sorts every bucket
+ * on the next byte, up to the last key byte held by the prefix. Buckets smaller than RADIX_SORT_MIN_BUCKET, buckets
+ * whose prefixes are all equal, and buckets past the last key byte fall back to sorting with 'compare', which also
+ * orders ties of keys longer than the prefix. A byte that all entries of a bucket share is skipped without moving them.
+ * Given a thread pool, the buckets of the first pass are sorted concurrently; the caller must not be a task of that pool.
+ *
+ * @param begin The first entry to sort.
+ * @param end One past the last entry to sort.
+ * @param byte The index of the prefix byte to distribute on.
+ * @param descending Whether to sort in descending order.
+ * @param compare The comparison sort order of the entries, KeyPrefixLess or KeyPrefixGreater.
+ * @param pool The thread pool sorting the buckets concurrently, or null.
+ */
+template <typename Compare>
+void msd_radix_sort(KeyPrefixEntry *begin, KeyPrefixEntry *end, size_t byte, bool descending, Compare compare, ThreadPool *pool = nullptr)
+{
+    size_t n = end - begin;
+    uint64_t prefix = begin->prefix;
+    if (n < RADIX_SORT_MIN_BUCKET || byte >= static_cast<size_t>(min(KEY_SIZE, KEY_PREFIX_SIZE)) ||
+        all_of(begin + 1, end, [prefix](const KeyPrefixEntry &e)
+               { return e.prefix == prefix; }))
+    {
+        sort(begin, end, compare);
+        return;
+    }
+
+    size_t counts[256] = {0};
+    for (KeyPrefixEntry *e = begin; e != end; e++)
+    {
+        counts[radix_digit(*e, byte, descending)]++;
+    }
+    if (counts[radix_digit(*begin, byte, descending)] == n)
+    {
+        msd_radix_sort(begin, end, byte + 1, descending, compare, pool);
+        return;
+    }
+
+    // Moves every entry into its bucket by swapping it with the next unplaced entry of that bucket
+    size_t next[256];
+    size_t bucket_end[256];
+    size_t offset = 0;
+    for (size_t d = 0; d < 256; d++)
+    {
+        next[d] = offset;
+        offset += counts[d];
+        bucket_end[d] = offset;
+    }
+    for (size_t d = 0; d < 256; d++)
+    {
+        while (next[d] < bucket_end[d])
+        {
+            size_t digit = radix_digit(begin[next[d]], byte, descending);
+            if (digit == d)
+            {
+                next[d]++;
+            }
+            else
+            {
+                swap(begin[next[d]], begin[next[digit]++]);
+            }
+        }
+    }
+
+    size_t bucket_begin = 0;
+    for (size_t d = 0; d < 256; d++)
+    {
+        KeyPrefixEntry *b = begin + bucket_begin;
+        KeyPrefixEntry *e = begin + bucket_end[d];
+        bucket_begin = bucket_end[d];
+        if (e - b <= 1)
+        {
+            continue;
+        }
+        if (pool)
+        {
+            pool->submit([b, e, byte, descending, compare]()
+                         { msd_radix_sort(b, e, byte + 1, descending, compare); });
+        }
+        else
+        {
+            msd_radix_sort(b, e, byte + 1, descending, compare);
+        }
+    }
+    if (pool)
+    {
+        pool->wait();
+    }
+}
+
+#endif
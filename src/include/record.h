@@ -3,11 +3,14 @@
 
 #include <iostream>
 #include <cstring>
+#include <utility>
+#include <keyCompare.h>
 
 using namespace std;
 
-extern long KEY_SIZE;
-extern long SIZE_OF_REC;
+extern thread_local long KEY_SIZE;
+extern thread_local long SIZE_OF_REC;
+extern thread_local KeyCompareFn KEY_COMPARE;
 
 class Record
 {
@@ -28,6 +31,12 @@ public:
         fread(m_chdata, 1, SIZE_OF_REC, file);
     }
 
+    // Constructs a Record object by copying raw data from memory.
+    Record(const char *data) : m_chdata(new char[SIZE_OF_REC])
+    {
+        memcpy(m_chdata, data, SIZE_OF_REC);
+    }
+
     // Destructor
     ~Record()
     {
@@ -41,9 +50,17 @@ public:
         memcpy(m_chdata, other.m_chdata, SIZE_OF_REC);
     }
 
+    // Move constructor, takes over the data of the other object without allocating
+    Record(Record &&other) noexcept : m_chdata(other.m_chdata)
+    {
+        other.m_chdata = nullptr;
+    }
+
     /**
      * @brief Assignment operator for Record objects.
      *
+     * The existing storage is reused, so assigning does not allocate unless the record was moved from.
+     *
      * @param other The Record object to copy data from.
      * @return A reference to the current Record object after assignment.
      */
@@ -52,13 +69,27 @@ public:
         // Check for self-assignment
         if (this != &other)
         {
-            delete[] m_chdata;
-            m_chdata = new char[SIZE_OF_REC];
+            if (!m_chdata)
+            {
+                m_chdata = new char[SIZE_OF_REC];
+            }
             memcpy(m_chdata, other.m_chdata, SIZE_OF_REC);
         }
         return *this;
     }
 
+    /**
+     * @brief Move assignment operator for Record objects.
+     *
+     * @param other The Record object to take the data from.
+     * @return A reference to the current Record object after assignment.
+     */
+    Record &operator=(Record &&other) noexcept
+    {
+        swap(m_chdata, other.m_chdata);
+        return *this;
+    }
+
     /**
      * @brief Accesses the record data at the specified index.
      *
@@ -81,70 +112,138 @@ public:
     }
 };
 
+/**
+ * @brief A non-owning view of a record stored elsewhere, e.g. in a RecordArena or a RunReader block.
+ *
+ * Copying a view only copies a pointer, so sorting and merging views never allocates.
+ * The viewed data must outlive the view.
+ */
+class RecordView
+{
+private:
+    const char *m_chdata;
+
+public:
+    RecordView() : m_chdata(nullptr) {}
+
+    // Constructs a view of the record starting at 'data'.
+    RecordView(const char *data) : m_chdata(data) {}
+
+    /**
+     * @brief Accesses the record data at the specified index.
+     *
+     * @param index The index of the data element to access.
+     * @return A const reference to the data element at the specified index.
+     */
+    const char &operator[](size_t index) const
+    {
+        return m_chdata[index];
+    }
+
+    /**
+     * @brief Returns a pointer to the raw data of the viewed record.
+     *
+     * @return A const pointer to the raw data of the viewed record.
+     */
+    const char *data() const
+    {
+        return m_chdata;
+    }
+};
+
+/**
+ * @brief Compares the keys of two raw records lexicographically in unsigned byte order.
+ *
+ * The comparison is KEY_COMPARE, specialized for the key width once at startup (see select_key_compare).
+ *
+ * @param k1 A pointer to the first record.
+ * @param k2 A pointer to the second record.
+ * @return A negative value if the first key is smaller, zero if they are equal and a positive value otherwise.
+ */
+inline int compare_keys(const char *k1, const char *k2)
+{
+    return KEY_COMPARE(k1, k2);
+}
+
 /**
  * @brief Checks if two records are equal.
  *
- * This function compares the keys of two Record objects element-wise.
+ * This function compares the keys of two Record objects in unsigned byte order.
  * It returns true if all elements are equal, otherwise false.
  *
  * @param r1 The first Record object to compare.
  * @param r2 The second Record object to compare.
  * @return True if the records are equal, otherwise false.
  */
-bool operator==(const Record &r1, const Record &r2)
+inline bool operator==(const Record &r1, const Record &r2)
 {
-    for (long i = 0; i < KEY_SIZE; ++i)
-    {
-        if (r1[i] != r2[i])
-        {
-            return false;
-        }
-    }
-    return true;
+    return compare_keys(r1.data(), r2.data()) == 0;
 }
 
 /**
  * @brief Compares two records lexicographically.
  *
- * This function compares the keys of two Record objects element-wise.
+ * This function compares the keys of two Record objects in unsigned byte order.
  * It returns true if the first record is less than the second record, otherwise false.
  *
  * @param r1 The first Record object to compare.
  * @param r2 The second Record object to compare.
  * @return True if the first record is less than the second record, otherwise false.
  */
-bool operator<(const Record &r1, const Record &r2)
+inline bool operator<(const Record &r1, const Record &r2)
 {
-    // Compare the keys of the two records lexicographically
-    for (long i = 0; i < KEY_SIZE; i++)
-    {
-        if (r1[i] < r2[i])
-        {
-            return true;
-        }
-        else if (r1[i] > r2[i])
-        {
-            return false;
-        }
-    }
-
-    // Two records are equal
-    return false;
+    return compare_keys(r1.data(), r2.data()) < 0;
 };
 
 /**
  * @brief Compares two records lexicographically.
  *
- * This function compares the keys of two Record objects element-wise.
+ * This function compares the keys of two Record objects in unsigned byte order.
  * It returns true if the first record is greater than the second record, otherwise false.
  *
  * @param r1 The first Record object to compare.
  * @param r2 The second Record object to compare.
  * @return True if the first record is greater than the second record, otherwise false.
  */
-bool operator>(const Record &r1, const Record &r2)
+inline bool operator>(const Record &r1, const Record &r2)
 {
-    return !(r1 < r2 || r1 == r2);
+    return compare_keys(r1.data(), r2.data()) > 0;
 };
 
+/**
+ * @brief Checks if the keys of two record views are equal.
+ *
+ * @param r1 The first RecordView to compare.
+ * @param r2 The second RecordView to compare.
+ * @return True if the keys are equal, otherwise false.
+ */
+inline bool operator==(const RecordView &r1, const RecordView &r2)
+{
+    return compare_keys(r1.data(), r2.data()) == 0;
+}
+
+/**
+ * @brief Compares the keys of two record views lexicographically.
+ *
+ * @param r1 The first RecordView to compare.
+ * @param r2 The second RecordView to compare.
+ * @return True if the first record is less than the second record, otherwise false.
+ */
+inline bool operator<(const RecordView &r1, const RecordView &r2)
+{
+    return compare_keys(r1.data(), r2.data()) < 0;
+}
+
+/**
+ * @brief Compares the keys of two record views lexicographically.
+ *
+ * @param r1 The first RecordView to compare.
+ * @param r2 The second RecordView to compare.
+ * @return True if the first record is greater than the second record, otherwise false.
+ */
+inline bool operator>(const RecordView &r1, const RecordView &r2)
+{
+    return compare_keys(r1.data(), r2.data()) > 0;
+}
+
 #endif
\ No newline at end of file
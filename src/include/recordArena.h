@@ -0,0 +1,155 @@
+#ifndef RECORDARENA_H
+#define RECORDARENA_H
+
+#include <memory>
+#include <new>
+#include <cstring>
+#include <sys/mman.h>
+#include <runIO.h>
+
+using namespace std;
+
+/**
+ * @brief A contiguous block of memory holding fixed-size records back to back.
+ *
+ * Record 'i' is the slice starting at byte i * rec_size, so a whole run is loaded
+ * with one read and one allocation instead of one allocation per record.
+ * The memory is mapped directly rather than taken from the heap, so it is returned to the system
+ * when the arena is destroyed and the next pass does not add its buffers to it.
+ */
+class RecordArena
+{
+    /**
+     * @brief Unmaps the memory of an arena.
+     */
+    struct Unmap
+    {
+        size_t length;
+
+        void operator()(char *data) const
+        {
+            munmap(data, length);
+        }
+    };
+
+    /**
+     * @brief Maps 'length' bytes of zeroed memory, throwing bad_alloc like new when it cannot.
+     */
+    static char *Allocate(size_t length)
+    {
+        void *data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+        {
+            throw bad_alloc();
+        }
+        return static_cast<char *>(data);
+    }
+
+    size_t m_rec_size;
+    size_t m_capacity; // Maximum number of records held by the arena
+    size_t m_size;     // Number of records currently held by the arena
+    unique_ptr<char, Unmap> m_data;
+
+public:
+    RecordArena(size_t rec_size, size_t capacity)
+        : m_rec_size(rec_size), m_capacity(capacity), m_size(0),
+          m_data(Allocate(max<size_t>(1, rec_size * capacity)), Unmap{max<size_t>(1, rec_size * capacity)}) {}
+
+    /**
+     * @brief Loads 'count' records starting at record index 'start' of a file into the arena.
+     *
+     * @param fd The file descriptor to read from.
+     * @param start The index of the first record to load.
+     * @param count The number of records to load, at most the capacity of the arena.
+     * @return True if all records were loaded, otherwise false.
+     */
+    bool Load(int fd, size_t start, size_t count)
+    {
+        m_size = min(count, m_capacity);
+        return read_fully(fd, m_data.get(), m_size * m_rec_size, start * m_rec_size);
+    }
+
+    /**
+     * @brief Loads 'count' records starting at record index 'start' of a file mapped in memory into the arena.
+     *
+     * @param map The start of the mapped file.
+     * @param start The index of the first record to load.
+     * @param count The number of records to load, at most the capacity of the arena.
+     * @return True, since copying from memory cannot fail.
+     */
+    bool Load(const char *map, size_t start, size_t count)
+    {
+        m_size = min(count, m_capacity);
+        memcpy(m_data.get(), map + start * m_rec_size, m_size * m_rec_size);
+        return true;
+    }
+
+    /**
+     * @brief Appends a copy of a record to the arena.
+     *
+     * @param record A pointer to the raw data of the record.
+     * @return True if the record was appended, false if the arena is full.
+     */
+    bool Push(const char *record)
+    {
+        if (m_size == m_capacity)
+        {
+            return false;
+        }
+        memcpy(m_data.get() + m_size * m_rec_size, record, m_rec_size);
+        m_size++;
+        return true;
+    }
+
+    /**
+     * @brief Removes all records from the arena, keeping its memory.
+     */
+    void clear()
+    {
+        m_size = 0;
+    }
+
+    /**
+     * @brief Returns a pointer to the record at the specified index.
+     *
+     * @param index The index of the record in the arena.
+     * @return A const pointer to the raw data of the record.
+     */
+    const char *operator[](size_t index) const
+    {
+        return m_data.get() + index * m_rec_size;
+    }
+
+    /**
+     * @brief Returns a writable pointer to the record at the specified index.
+     *
+     * @param index The index of the record in the arena.
+     * @return A pointer to the raw data of the record.
+     */
+    char *operator[](size_t index)
+    {
+        return m_data.get() + index * m_rec_size;
+    }
+
+    /**
+     * @brief Gets the number of records held by the arena.
+     *
+     * @return The number of records in the arena.
+     */
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    /**
+     * @brief Gets the maximum number of records the arena can hold.
+     *
+     * @return The capacity of the arena in records.
+     */
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+};
+
+#endif
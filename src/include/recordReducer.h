@@ -0,0 +1,355 @@
+#ifndef RECORDREDUCER_H
+#define RECORDREDUCER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <record.h>
+#include <keySpec.h>
+
+using namespace std;
+
+/**
+ * @brief How a combined field folds the values of the records with equal keys.
+ */
+enum CombineOp
+{
+    COMBINE_COUNT, // Number of records, every input record counting as one
+    COMBINE_SUM,   // Sum of the values, integers wrapping around like native ones
+    COMBINE_MIN,   // Smallest value
+    COMBINE_MAX    // Largest value
+};
+
+/**
+ * @brief A numeric field of the records, combined over the records with equal keys.
+ */
+struct CombineField
+{
+    CombineOp op;
+    KeyField field; // Place of the field in the sorted record, and its type
+};
+
+/**
+ * @brief Collapses the records with equal keys into one record, keeping the first or the last of them,
+ * optionally with numeric fields combined over all of them.
+ *
+ * The unique mode is "first" or "last", in the order of the input. A combine spec is a comma-separated list
+ * of fields 'op:offset:length:type', where the op is 'count', 'sum', 'min' or 'max' and the type is one of the
+ * numeric types of KeySpec, e.g. "count:16:4:u32le,sum:20:8:i64le". The record kept gets the combined value
+ * of each field; a count field is set to one on every input record and then summed, so runs that were already
+ * reduced can be reduced again by later merges. Combined fields cannot overlap the key or each other.
+ */
+class RecordReducer
+{
+    vector<CombineField> m_fields;
+    bool m_enabled;
+    bool m_keep_last;
+
+    /**
+     * @brief Reads a numeric field as an unsigned integer of its bits, most significant byte first.
+     */
+    static uint64_t Load(const char *record, const KeyField &field)
+    {
+        const unsigned char *src = reinterpret_cast<const unsigned char *>(record + field.offset);
+        uint64_t bits = 0;
+        for (size_t b = 0; b < field.length; b++)
+        {
+            bits = (bits << 8) | src[field.little_endian ? field.length - 1 - b : b];
+        }
+        return bits;
+    }
+
+    /**
+     * @brief Writes the low bytes of 'bits' into a numeric field, in its byte order.
+     */
+    static void Store(char *record, const KeyField &field, uint64_t bits)
+    {
+        unsigned char *dst = reinterpret_cast<unsigned char *>(record + field.offset);
+        for (size_t b = 0; b < field.length; b++)
+        {
+            dst[field.little_endian ? b : field.length - 1 - b] = static_cast<unsigned char>(bits >> (8 * b));
+        }
+    }
+
+    /**
+     * @brief Folds the values 'a' and 'b' of a field, given as their bits.
+     */
+    static uint64_t Fold(CombineOp op, const KeyField &field, uint64_t a, uint64_t b)
+    {
+        if (op == COMBINE_COUNT || op == COMBINE_SUM)
+        {
+            if (field.type != KEY_FLOAT)
+            {
+                return a + b; // Two's complement sums only differ in the bits that are not stored
+            }
+            if (field.length == sizeof(float))
+            {
+                uint32_t a32 = static_cast<uint32_t>(a), b32 = static_cast<uint32_t>(b), sum32;
+                float x, y;
+                memcpy(&x, &a32, sizeof(x));
+                memcpy(&y, &b32, sizeof(y));
+                x += y;
+                memcpy(&sum32, &x, sizeof(sum32));
+                return sum32;
+            }
+            double x, y;
+            memcpy(&x, &a, sizeof(x));
+            memcpy(&y, &b, sizeof(y));
+            x += y;
+            memcpy(&a, &x, sizeof(a));
+            return a;
+        }
+
+        bool b_less;
+        if (field.type == KEY_UINT)
+        {
+            b_less = b < a;
+        }
+        else if (field.type == KEY_INT)
+        {
+            int shift = static_cast<int>(64 - 8 * field.length);
+            b_less = static_cast<int64_t>(b << shift) < static_cast<int64_t>(a << shift);
+        }
+        else
+        {
+            // Floats are ordered like their normalized --key bytes, a total order that places NaNs past the infinities
+            // on the side of their sign, so the result does not depend on how the records were grouped
+            int shift = static_cast<int>(64 - 8 * field.length);
+            uint64_t sign = uint64_t(1) << 63;
+            uint64_t x = a << shift, y = b << shift;
+            x = (x & sign) ? ~x : x | sign;
+            y = (y & sign) ? ~y : y | sign;
+            b_less = y < x;
+        }
+        return (op == COMBINE_MIN) == b_less ? b : a;
+    }
+
+public:
+    RecordReducer() : m_enabled(false), m_keep_last(false) {}
+
+    /**
+     * @brief Compiles a unique mode and a combine spec.
+     *
+     * @param unique "first" or "last", or empty for "first" when fields are combined and no reduction otherwise.
+     * @param combine The combined fields, see the class description, or empty.
+     * @param rec_size The size of the records, which every field must fit in.
+     * @param key_size The size of the key at the start of the records, when 'key' is empty.
+     * @param key The fields of the key, or empty.
+     * @param offset The offset of the records within the records sorted, after their normalized key.
+     * @param reducer Receives the compiled reducer.
+     * @return True if the mode and the spec are valid, otherwise false.
+     */
+    static bool Parse(const string &unique, const string &combine, size_t rec_size, size_t key_size, const KeySpec &key, size_t offset,
+                      RecordReducer &reducer)
+    {
+        reducer.m_fields.clear();
+        reducer.m_enabled = !unique.empty() || !combine.empty();
+        reducer.m_keep_last = unique == "last";
+        if (!unique.empty() && unique != "first" && unique != "last")
+        {
+            return false;
+        }
+        for (size_t start = 0; !combine.empty() && start <= combine.size();)
+        {
+            size_t end = combine.find(',', start);
+            if (end == string::npos)
+            {
+                end = combine.size();
+            }
+            vector<string> parts;
+            for (size_t p = start; p <= end;)
+            {
+                size_t colon = combine.find(':', p);
+                if (colon == string::npos || colon > end)
+                {
+                    colon = end;
+                }
+                parts.push_back(combine.substr(p, colon - p));
+                p = colon + 1;
+            }
+            start = end + 1;
+
+            CombineField combined = {COMBINE_COUNT, {0, 0, KEY_BYTES, false, false}};
+            if (parts.size() != 4 || parts[1].empty() || parts[2].empty() ||
+                parts[1].find_first_not_of("0123456789") != string::npos || parts[2].find_first_not_of("0123456789") != string::npos)
+            {
+                return false;
+            }
+            if (parts[0] == "sum")
+            {
+                combined.op = COMBINE_SUM;
+            }
+            else if (parts[0] == "min")
+            {
+                combined.op = COMBINE_MIN;
+            }
+            else if (parts[0] == "max")
+            {
+                combined.op = COMBINE_MAX;
+            }
+            else if (parts[0] != "count")
+            {
+                return false;
+            }
+            KeyField &field = combined.field;
+            field.offset = strtoul(parts[1].c_str(), nullptr, 10);
+            field.length = strtoul(parts[2].c_str(), nullptr, 10);
+            if (field.length == 0 || field.offset + field.length > rec_size || !KeySpec::ParseType(parts[3], field) ||
+                field.type == KEY_BYTES || (combined.op == COMBINE_COUNT && field.type == KEY_FLOAT))
+            {
+                return false;
+            }
+
+            // Changing the key would unsort the records, and two ops cannot share the bytes of a field
+            bool overlaps_key = key.empty() ? field.offset < key_size : key.Overlaps(field.offset, field.length);
+            for (size_t i = 0; i < reducer.m_fields.size() && !overlaps_key; i++)
+            {
+                const KeyField &other = reducer.m_fields[i].field;
+                overlaps_key = field.offset < other.offset + other.length && other.offset < field.offset + field.length;
+            }
+            if (overlaps_key)
+            {
+                return false;
+            }
+            reducer.m_fields.push_back(combined);
+        }
+        for (size_t i = 0; i < reducer.m_fields.size(); i++)
+        {
+            reducer.m_fields[i].field.offset += offset;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Checks if records are not reduced at all.
+     */
+    bool empty() const
+    {
+        return !m_enabled;
+    }
+
+    /**
+     * @brief Checks if the last record of every key is kept, rather than the first.
+     */
+    bool keep_last() const
+    {
+        return m_keep_last;
+    }
+
+    /**
+     * @brief Prepares a record read from the input, counting it as one record.
+     *
+     * @param record A pointer to the raw data of the sorted record.
+     */
+    void Init(char *record) const
+    {
+        for (size_t i = 0; i < m_fields.size(); i++)
+        {
+            if (m_fields[i].op == COMBINE_COUNT)
+            {
+                Store(record, m_fields[i].field, 1);
+            }
+        }
+    }
+
+    /**
+     * @brief Folds the combined fields of a record with the same key into the record kept.
+     *
+     * @param kept The record kept, receiving the combined values.
+     * @param record The record folded into it.
+     */
+    void Combine(char *kept, const char *record) const
+    {
+        for (size_t i = 0; i < m_fields.size(); i++)
+        {
+            const KeyField &field = m_fields[i].field;
+            Store(kept, field, Fold(m_fields[i].op, field, Load(kept, field), Load(record, field)));
+        }
+    }
+};
+
+/**
+ * @brief Reduces a sorted stream of records to one record per key, one record at a time.
+ *
+ * The record of the key being reduced is built in one of two buffers, so that the record completed last
+ * stays valid while the next key is reduced in the other one.
+ * A stable merge hands the records of a key in the order of the input. The sort of pass 0 does not keep that order,
+ * but it sorts records of one arena, which holds them in the order of the input, so with 'by_address' the order
+ * of the records of a key is the order of their addresses.
+ */
+class ReduceStream
+{
+    const RecordReducer *m_reducer;
+    size_t m_rec_size;
+    vector<char> m_buffers;  // Two records, the one being reduced and the one completed last
+    size_t m_current;        // Index of the buffer of the record being reduced
+    const char *m_source;    // Record of the stream kept for the key being reduced, with 'by_address'
+    bool m_by_address;
+    bool m_pending;          // Whether a key is being reduced
+
+    char *Buffer(size_t index)
+    {
+        return m_buffers.data() + index * m_rec_size;
+    }
+
+public:
+    ReduceStream(const RecordReducer &reducer, size_t rec_size, bool by_address)
+        : m_reducer(&reducer), m_rec_size(rec_size), m_buffers(2 * rec_size), m_current(0), m_source(nullptr),
+          m_by_address(by_address), m_pending(false) {}
+
+    /**
+     * @brief Adds the next record of the sorted stream.
+     *
+     * @param record A pointer to the raw data of the record, which is copied.
+     * @return The reduced record of the previous key when the record starts a new key, valid until the next call,
+     *         otherwise null.
+     */
+    const char *Add(const char *record)
+    {
+        char *current = Buffer(m_current);
+        if (m_pending && compare_keys(current, record) == 0)
+        {
+            // The record kept is replaced by a later record with "last", or by an earlier one with "first"
+            bool later = !m_by_address || record > m_source;
+            if (later == m_reducer->keep_last())
+            {
+                char *other = Buffer(1 - m_current);
+                memcpy(other, record, m_rec_size);
+                m_reducer->Combine(other, current);
+                m_current = 1 - m_current;
+                m_source = record;
+            }
+            else
+            {
+                m_reducer->Combine(current, record);
+            }
+            return nullptr;
+        }
+
+        const char *completed = m_pending ? current : nullptr;
+        m_current = 1 - m_current;
+        memcpy(Buffer(m_current), record, m_rec_size);
+        m_source = record;
+        m_pending = true;
+        return completed;
+    }
+
+    /**
+     * @brief Ends the stream.
+     *
+     * @return The reduced record of the last key, valid until the next call, or null if the stream was empty.
+     */
+    const char *Flush()
+    {
+        if (!m_pending)
+        {
+            return nullptr;
+        }
+        m_pending = false;
+        return Buffer(m_current);
+    }
+};
+
+#endif
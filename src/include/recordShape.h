@@ -0,0 +1,83 @@
+#ifndef RECORDSHAPE_H
+#define RECORDSHAPE_H
+
+#include <keyCompare.h>
+
+using namespace std;
+
+// The shape of the records sorted on the current thread, installed by RecordShape::Install()
+extern thread_local long KEY_SIZE;
+extern thread_local long SIZE_OF_REC;
+extern thread_local KeyCompareFn KEY_COMPARE;
+
+/**
+ * @brief The size of the records and of their keys, with the comparison of the keys.
+ *
+ * Records, arenas and sorters read the shape from thread-local globals, so sorts of different shapes can run
+ * in one process as long as every thread working on a sort has its shape installed. ThreadPool installs the shape
+ * of the submitting thread before running each task.
+ */
+struct RecordShape
+{
+    long key_size;
+    long rec_size;
+    KeyCompareFn key_compare;
+
+    /**
+     * @brief Describes records of the given sizes, with keys compared in unsigned byte order.
+     *
+     * @param rec_size The size of each record in bytes.
+     * @param key_size The size of the key at the start of each record in bytes.
+     * @return The record shape.
+     */
+    static RecordShape Make(long rec_size, long key_size)
+    {
+        RecordShape shape = {key_size, rec_size, select_key_compare(key_size)};
+        return shape;
+    }
+
+    /**
+     * @brief Returns the shape installed on the calling thread.
+     *
+     * @return The current record shape.
+     */
+    static RecordShape Current()
+    {
+        RecordShape shape = {KEY_SIZE, SIZE_OF_REC, KEY_COMPARE};
+        return shape;
+    }
+
+    /**
+     * @brief Installs the shape on the calling thread.
+     */
+    void Install() const
+    {
+        KEY_SIZE = key_size;
+        SIZE_OF_REC = rec_size;
+        KEY_COMPARE = key_compare;
+    }
+};
+
+/**
+ * @brief Installs a record shape on the calling thread for the lifetime of the object, then restores the previous one.
+ */
+class RecordShapeScope
+{
+    RecordShape m_previous;
+
+    RecordShapeScope(const RecordShapeScope &);
+    RecordShapeScope &operator=(const RecordShapeScope &);
+
+public:
+    explicit RecordShapeScope(const RecordShape &shape) : m_previous(RecordShape::Current())
+    {
+        shape.Install();
+    }
+
+    ~RecordShapeScope()
+    {
+        m_previous.Install();
+    }
+};
+
+#endif
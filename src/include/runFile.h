@@ -0,0 +1,262 @@
+#ifndef RUNFILE_H
+#define RUNFILE_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <runIO.h>
+#include <recordArena.h>
+
+using namespace std;
+
+/**
+ * @brief An open file of fixed-size records, read and written either streamed or through a memory mapping.
+ *
+ * Readers, writers and arena loads are created through the file, so callers do not depend on how it is accessed.
+ * A file given codec counters holds runs of compressed frames, which are only accessed through readers and writers.
+ */
+class RunFile
+{
+    FILE *m_file;
+    char *m_map;       // Mapping of the file, or null when streaming
+    size_t m_map_size; // Size of the mapping in bytes
+    size_t m_rec_size;
+    CodecStats *m_codec; // Counters of the compression of the runs, or null if they are not compressed
+    PhaseCounters *m_counters; // Counters of the phase reading or writing the file, or null
+
+    RunFile(const RunFile &);
+    RunFile &operator=(const RunFile &);
+
+public:
+    RunFile(size_t rec_size) : m_file(nullptr), m_map(nullptr), m_map_size(0), m_rec_size(rec_size), m_codec(nullptr), m_counters(nullptr) {}
+
+    ~RunFile()
+    {
+        Close();
+    }
+
+    /**
+     * @brief Opens the file with an fopen mode.
+     *
+     * @param path The name of the file.
+     * @param mode The fopen mode, "rb" to read or "wb" to create and write.
+     * @return True if the file was opened, otherwise false.
+     */
+    bool Open(const string &path, const char *mode)
+    {
+        Close();
+        m_file = fopen(path.c_str(), mode);
+        return m_file != nullptr;
+    }
+
+    /**
+     * @brief Makes the readers and writers of the file compress its runs.
+     *
+     * @param codec The counters of the compression, or null to store the runs raw.
+     */
+    void SetCodec(CodecStats *codec)
+    {
+        m_codec = codec;
+    }
+
+    /**
+     * @brief Makes the streaming readers and writers of the file count their I/O time.
+     *
+     * @param counters The counters of the phase, or null to count nothing.
+     */
+    void SetCounters(PhaseCounters *counters)
+    {
+        m_counters = counters;
+    }
+
+    /**
+     * @brief Checks if the runs of the file are compressed.
+     *
+     * @return True if the file holds compressed frames, otherwise false.
+     */
+    bool IsCompressed() const
+    {
+        return m_codec != nullptr;
+    }
+
+    /**
+     * @brief Unmaps and closes the file.
+     */
+    void Close()
+    {
+        Unmap();
+        if (m_file)
+        {
+            fclose(m_file);
+            m_file = nullptr;
+        }
+    }
+
+    /**
+     * @brief Maps the first 'num_of_records' records of the file in memory for sequential access.
+     *
+     * A writable mapping first sets the size of the file to exactly 'num_of_records' records.
+     * If mapping fails, or the file is compressed, the file stays streamed.
+     *
+     * @param num_of_records The number of records to map.
+     * @param writable Whether the mapping is written to.
+     * @return True if the file is mapped, otherwise false.
+     */
+    bool Map(size_t num_of_records, bool writable)
+    {
+        Unmap();
+        size_t size = num_of_records * m_rec_size;
+        if (!m_file || size == 0 || m_codec)
+        {
+            return false;
+        }
+        if (writable && ftruncate(fd(), static_cast<off_t>(size)) != 0)
+        {
+            return false;
+        }
+        void *map = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd(), 0);
+        if (map == MAP_FAILED)
+        {
+            return false;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        m_map = static_cast<char *>(map);
+        m_map_size = size;
+        return true;
+    }
+
+    /**
+     * @brief Removes the mapping of the file, if any.
+     */
+    void Unmap()
+    {
+        if (m_map)
+        {
+            munmap(m_map, m_map_size);
+            m_map = nullptr;
+            m_map_size = 0;
+        }
+    }
+
+    /**
+     * @brief Checks if the file is mapped in memory.
+     *
+     * @return True if the file is mapped, false if it is streamed.
+     */
+    bool IsMapped() const
+    {
+        return m_map != nullptr;
+    }
+
+    /**
+     * @brief Returns the file descriptor of the file.
+     *
+     * @return The file descriptor.
+     */
+    int fd() const
+    {
+        return fileno(m_file);
+    }
+
+    /**
+     * @brief Gets the size of the file.
+     *
+     * @param size Receives the size of the file in bytes.
+     * @return True if the size was read, otherwise false.
+     */
+    bool GetSize(size_t &size) const
+    {
+        struct stat st;
+        if (!m_file || fstat(fd(), &st) != 0)
+        {
+            return false;
+        }
+        size = static_cast<size_t>(st.st_size);
+        return true;
+    }
+
+    /**
+     * @brief Opens a reader over the records [start, end) of the file.
+     *
+     * @param start The index of the first record.
+     * @param end One past the index of the last record.
+     * @param block_records The number of records per block when streaming.
+     * @param io The I/O thread pool prefetching blocks when streaming, or null.
+     * @return A reader over the mapping, or a streaming reader.
+     */
+    RunReader OpenReader(size_t start, size_t end, size_t block_records, ThreadPool *io = nullptr) const
+    {
+        if (m_map)
+        {
+            return RunReader(m_map, m_rec_size, start, end);
+        }
+        return RunReader(fd(), m_rec_size, start, end, block_records, io, m_codec, m_counters);
+    }
+
+    /**
+     * @brief Opens a writer storing records in the file from record index 'start'.
+     *
+     * @param start The index where the first record is written.
+     * @param block_records The number of records per block when streaming.
+     * @param io The I/O thread pool writing blocks behind when streaming, or null.
+     * @return A writer into the mapping, or a streaming writer.
+     */
+    RunWriter OpenWriter(size_t start, size_t block_records, ThreadPool *io = nullptr)
+    {
+        if (m_map)
+        {
+            return RunWriter(m_map, m_rec_size, start);
+        }
+        return RunWriter(fd(), m_rec_size, start, block_records, io, m_codec, m_counters);
+    }
+
+    /**
+     * @brief Loads 'count' records starting at record index 'start' into an arena.
+     *
+     * @param arena The arena receiving the records.
+     * @param start The index of the first record to load.
+     * @param count The number of records to load.
+     * @return True if all records were loaded, otherwise false, which is always the case for a compressed file.
+     */
+    bool LoadArena(RecordArena &arena, size_t start, size_t count) const
+    {
+        if (m_codec)
+        {
+            return false;
+        }
+        if (!m_counters)
+        {
+            return m_map ? arena.Load(m_map, start, count) : arena.Load(fd(), start, count);
+        }
+        chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        bool loaded = m_map ? arena.Load(m_map, start, count) : arena.Load(fd(), start, count);
+        m_counters->read_ns += elapsed_ns(begin);
+        return loaded;
+    }
+
+    /**
+     * @brief Reads 'count' records starting at record index 'start'.
+     *
+     * @param buf The destination buffer.
+     * @param start The index of the first record to read.
+     * @param count The number of records to read.
+     * @return True if all records were read, otherwise false, which is always the case for a compressed file.
+     */
+    bool ReadRecords(char *buf, size_t start, size_t count) const
+    {
+        if (m_codec)
+        {
+            return false;
+        }
+        if (m_map)
+        {
+            memcpy(buf, m_map + start * m_rec_size, count * m_rec_size);
+            return true;
+        }
+        return read_fully(fd(), buf, count * m_rec_size, start * m_rec_size);
+    }
+};
+
+#endif
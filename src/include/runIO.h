@@ -0,0 +1,704 @@
+#ifndef RUNIO_H
+#define RUNIO_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <unistd.h>
+#include <threadPool.h>
+#include <blockCodec.h>
+#include <sortTrace.h>
+
+using namespace std;
+
+/**
+ * @brief Reads exactly 'n' bytes from a file descriptor at the given byte offset.
+ *
+ * @param fd The file descriptor to read from.
+ * @param buf The destination buffer.
+ * @param n The number of bytes to read.
+ * @param offset The byte offset in the file to start reading from.
+ * @return True if all bytes were read, otherwise false.
+ */
+inline bool read_fully(int fd, char *buf, size_t n, size_t offset)
+{
+    while (n > 0)
+    {
+        ssize_t got = pread(fd, buf, n, static_cast<off_t>(offset));
+        if (got <= 0)
+        {
+            return false;
+        }
+        buf += got;
+        offset += got;
+        n -= got;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes exactly 'n' bytes to a file descriptor at the given byte offset.
+ *
+ * @param fd The file descriptor to write to.
+ * @param buf The source buffer.
+ * @param n The number of bytes to write.
+ * @param offset The byte offset in the file to start writing at.
+ * @return True if all bytes were written, otherwise false.
+ */
+inline bool write_fully(int fd, const char *buf, size_t n, size_t offset)
+{
+    while (n > 0)
+    {
+        ssize_t put = pwrite(fd, buf, n, static_cast<off_t>(offset));
+        if (put <= 0)
+        {
+            return false;
+        }
+        buf += put;
+        offset += put;
+        n -= put;
+    }
+    return true;
+}
+
+/**
+ * @brief Decides if a file should be sorted through memory mappings instead of streamed I/O.
+ *
+ * Mapping pays off when the input and output mappings of a pass stay in the page cache next to
+ * the sorter's own memory, so the free physical memory must hold both mappings and the budget.
+ *
+ * @param file_size The size of the input file in bytes.
+ * @param mem_in_bytes The memory budget of the sorter in bytes.
+ * @return True if the file should be mapped, otherwise false.
+ */
+inline bool should_mmap(size_t file_size, size_t mem_in_bytes)
+{
+    long free_pages = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (file_size == 0 || free_pages <= 0 || page_size <= 0)
+    {
+        return false;
+    }
+    size_t free_bytes = static_cast<size_t>(free_pages) * static_cast<size_t>(page_size);
+    return 2 * file_size + mem_in_bytes <= free_bytes;
+}
+
+/**
+ * @brief Runs a read or write on an I/O thread pool.
+ *
+ * @param io The thread pool running the I/O.
+ * @param op The read or write, returning true on success.
+ * @return A future holding the result of the operation.
+ */
+inline future<bool> submit_io(ThreadPool *io, function<bool()> op)
+{
+    shared_ptr<packaged_task<bool()>> task = make_shared<packaged_task<bool()>>(op);
+    future<bool> result = task->get_future();
+    io->submit([task]()
+               { (*task)(); });
+    return result;
+}
+
+// Size of the header of a compressed frame: the stored size of its payload and its number of records
+const size_t FRAME_HEADER_SIZE = 2 * sizeof(uint32_t);
+
+// Raw size of the records of a compressed frame
+const size_t COMPRESSED_FRAME_SIZE = 256 * 1024;
+
+/**
+ * @brief Returns the number of records held by each compressed frame.
+ */
+inline size_t frame_records(size_t rec_size)
+{
+    return max<size_t>(1, COMPRESSED_FRAME_SIZE / rec_size);
+}
+
+/**
+ * @brief Returns the byte offset in a compressed run file of the run starting at record index 'start'.
+ *
+ * Each record owns a slot large enough for itself and a frame header, so a run starting at any record index
+ * can be written without knowing the compressed size of the runs before it. The gaps left behind by the
+ * compression are holes of a sparse file and take no disk space.
+ */
+inline size_t compressed_offset(size_t start, size_t rec_size)
+{
+    return start * (rec_size + FRAME_HEADER_SIZE);
+}
+
+/**
+ * @brief Returns the size on disk of the frame whose header is at 'frame'.
+ */
+inline size_t frame_size(const char *frame)
+{
+    uint32_t stored;
+    memcpy(&stored, frame, sizeof(stored));
+    return FRAME_HEADER_SIZE + stored;
+}
+
+/**
+ * @brief Returns the number of records of the frame whose header is at 'frame'.
+ */
+inline size_t frame_count(const char *frame)
+{
+    uint32_t count;
+    memcpy(&count, frame + sizeof(uint32_t), sizeof(count));
+    return count;
+}
+
+/**
+ * @brief Compresses records into a frame and writes it to a file descriptor.
+ *
+ * Records that do not compress are stored raw, which the reader recognizes by a payload of their raw size.
+ *
+ * @param fd The file descriptor to write to.
+ * @param offset The byte offset of the frame in the file.
+ * @param records The records to write.
+ * @param count The number of records.
+ * @param rec_size The size of each record.
+ * @param frame A buffer of FRAME_HEADER_SIZE + count * rec_size bytes holding the frame.
+ * @param stats The counters of the compression.
+ * @return True if the frame was written, otherwise false.
+ */
+inline bool write_frame(int fd, size_t offset, const char *records, size_t count, size_t rec_size, char *frame, CodecStats *stats)
+{
+    size_t raw = count * rec_size;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    size_t stored = lz_compress(records, raw, frame + FRAME_HEADER_SIZE, raw);
+    stats->compress_ns += elapsed_ns(start);
+    if (stored == 0)
+    {
+        memcpy(frame + FRAME_HEADER_SIZE, records, raw);
+        stored = raw;
+    }
+    uint32_t header[2] = {static_cast<uint32_t>(stored), static_cast<uint32_t>(count)};
+    memcpy(frame, header, FRAME_HEADER_SIZE);
+    stats->raw_bytes += raw;
+    stats->compressed_bytes += FRAME_HEADER_SIZE + stored;
+    return write_fully(fd, frame, FRAME_HEADER_SIZE + stored, offset);
+}
+
+/**
+ * @brief Reads a frame from a file descriptor and decompresses its records.
+ *
+ * @param fd The file descriptor to read from.
+ * @param offset The byte offset of the frame in the file.
+ * @param rec_size The size of each record.
+ * @param max_records The largest number of records the frame may hold.
+ * @param frame A buffer of FRAME_HEADER_SIZE + max_records * rec_size bytes receiving the frame.
+ * @param records The buffer receiving the records.
+ * @param stats The counters of the compression.
+ * @return True if the frame was read and is valid, otherwise false.
+ */
+inline bool read_frame(int fd, size_t offset, size_t rec_size, size_t max_records, char *frame, char *records, CodecStats *stats)
+{
+    if (!read_fully(fd, frame, FRAME_HEADER_SIZE, offset))
+    {
+        return false;
+    }
+    size_t count = frame_count(frame);
+    size_t stored = frame_size(frame) - FRAME_HEADER_SIZE;
+    size_t raw = count * rec_size;
+    if (count == 0 || count > max_records || stored > raw ||
+        !read_fully(fd, frame + FRAME_HEADER_SIZE, stored, offset + FRAME_HEADER_SIZE))
+    {
+        return false;
+    }
+    if (stored == raw)
+    {
+        memcpy(records, frame + FRAME_HEADER_SIZE, raw);
+        return true;
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool ok = lz_decompress(frame + FRAME_HEADER_SIZE, stored, records, raw);
+    stats->decompress_ns += elapsed_ns(start);
+    return ok;
+}
+
+/**
+ * @brief Streams the records of a sorted run from disk in large contiguous blocks.
+ *
+ * The reader covers the record range [start, end) of a file and fetches up to
+ * 'block_records' records per read, so consumers only ever touch records in memory.
+ * Given an I/O thread pool, the next block is prefetched into a second buffer while the
+ * current one is consumed, so refills only wait when the disk falls behind.
+ * Over a mapped file, the whole range is one block read in place.
+ * Given codec counters, the run is read as the compressed frames written by RunWriter, one frame per block,
+ * and the frames are decompressed by the thread reading them.
+ */
+class RunReader
+{
+    int m_fd;
+    size_t m_rec_size;
+    size_t m_next;          // Index of the next record to fetch from disk
+    size_t m_end;           // One past the index of the last record of the run
+    size_t m_block_records; // Capacity of the block in records
+    vector<char> m_block;
+    size_t m_pos;   // Position of the current record within the block
+    size_t m_count; // Number of records held by the block
+    bool m_failed;
+    ThreadPool *m_io;       // I/O thread pool prefetching blocks, or null to read synchronously
+    vector<char> m_spare;   // Block being prefetched
+    future<bool> m_pending; // Result of the prefetch
+    size_t m_pending_count; // Number of records being prefetched
+    const char *m_data;     // Start of the current block, in m_block or in a mapped file
+    CodecStats *m_codec;    // Counters of the decompression, or null if the run is not compressed
+    vector<char> m_frame;   // Compressed frame being read
+    size_t m_next_byte;     // Byte offset of the next compressed frame
+    PhaseCounters *m_counters; // Counters receiving the time spent reading, or null
+
+    /**
+     * @brief Starts reading the next block of the run into the spare buffer.
+     */
+    void Prefetch()
+    {
+        m_pending_count = min(m_block_records, m_end - m_next);
+        if (!m_io || m_pending_count == 0)
+        {
+            return;
+        }
+        int fd = m_fd;
+        char *buf = m_spare.data();
+        if (m_codec)
+        {
+            // The size of a frame is only known once it is read, so the reader advances when the prefetch completes
+            char *frame = m_frame.data();
+            size_t rec_size = m_rec_size;
+            size_t max_records = m_pending_count;
+            size_t offset = m_next_byte;
+            CodecStats *codec = m_codec;
+            m_pending = submit_io(m_io, [fd, offset, rec_size, max_records, frame, buf, codec]()
+                                  { return read_frame(fd, offset, rec_size, max_records, frame, buf, codec); });
+            return;
+        }
+        size_t n = m_pending_count * m_rec_size;
+        size_t offset = m_next * m_rec_size;
+        m_pending = submit_io(m_io, [fd, buf, n, offset]()
+                              { return read_fully(fd, buf, n, offset); });
+        m_next += m_pending_count;
+    }
+
+    /**
+     * @brief Fetches the next block of the run, adding the time it takes to the counters.
+     */
+    void Refill()
+    {
+        if (!m_counters)
+        {
+            Fetch();
+            return;
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        Fetch();
+        m_counters->read_ns += elapsed_ns(start);
+    }
+
+    /**
+     * @brief Fetches the next block of the run from disk.
+     */
+    void Fetch()
+    {
+        m_pos = 0;
+        m_count = 0;
+        if (m_io)
+        {
+            // Takes over the prefetched block and starts prefetching the one after it
+            if (!m_pending.valid())
+            {
+                return;
+            }
+            if (!m_pending.get())
+            {
+                m_failed = true;
+                return;
+            }
+            swap(m_block, m_spare);
+            m_data = m_block.data();
+            m_count = m_pending_count;
+            if (m_codec)
+            {
+                m_count = frame_count(m_frame.data());
+                m_next += m_count;
+                m_next_byte += frame_size(m_frame.data());
+            }
+            Prefetch();
+            return;
+        }
+
+        m_count = min(m_block_records, m_end - m_next);
+        if (m_count == 0)
+        {
+            return;
+        }
+        if (m_codec)
+        {
+            if (!read_frame(m_fd, m_next_byte, m_rec_size, m_count, m_frame.data(), m_block.data(), m_codec))
+            {
+                m_failed = true;
+                m_count = 0;
+                return;
+            }
+            m_count = frame_count(m_frame.data());
+            m_next_byte += frame_size(m_frame.data());
+        }
+        else if (!read_fully(m_fd, m_block.data(), m_count * m_rec_size, m_next * m_rec_size))
+        {
+            m_failed = true;
+            m_count = 0;
+            return;
+        }
+        m_data = m_block.data();
+        m_next += m_count;
+    }
+
+public:
+    RunReader(int fd, size_t rec_size, size_t start, size_t end, size_t block_records, ThreadPool *io = nullptr,
+              CodecStats *codec = nullptr, PhaseCounters *counters = nullptr)
+        : m_fd(fd), m_rec_size(rec_size), m_next(start), m_end(end),
+          m_block_records(max<size_t>(1, min(codec ? frame_records(rec_size) : block_records, end - start))),
+          m_block(m_block_records * rec_size), m_pos(0), m_count(0), m_failed(false),
+          m_io(io), m_spare(io ? m_block_records * rec_size : 0), m_pending_count(0), m_data(m_block.data()),
+          m_codec(codec), m_frame(codec ? FRAME_HEADER_SIZE + m_block_records * rec_size : 0),
+          m_next_byte(compressed_offset(start, rec_size)), m_counters(counters)
+    {
+        Prefetch();
+        Refill();
+    }
+
+    // Constructs a reader over the records [start, end) of a file mapped in memory, without copying them.
+    RunReader(const char *map, size_t rec_size, size_t start, size_t end)
+        : m_fd(-1), m_rec_size(rec_size), m_next(end), m_end(end), m_block_records(end - start),
+          m_pos(0), m_count(end - start), m_failed(false), m_io(nullptr), m_pending_count(0),
+          m_data(map + start * rec_size), m_codec(nullptr), m_next_byte(0), m_counters(nullptr) {}
+
+    RunReader(RunReader &&other) = default;
+    RunReader &operator=(RunReader &&other) = default;
+
+    ~RunReader()
+    {
+        // The prefetch must not outlive the buffer it reads into
+        if (m_pending.valid())
+        {
+            m_pending.wait();
+        }
+    }
+
+    /**
+     * @brief Checks if all records of the run have been consumed.
+     *
+     * @return True if there are no more records, otherwise false.
+     */
+    bool empty() const
+    {
+        return m_pos >= m_count;
+    }
+
+    /**
+     * @brief Returns a pointer to the current record.
+     *
+     * @return A const pointer to the raw data of the current record.
+     */
+    const char *current() const
+    {
+        return m_data + m_pos * m_rec_size;
+    }
+
+    /**
+     * @brief Moves to the next record, reading the next block when the current one is consumed.
+     */
+    void advance()
+    {
+        if (++m_pos >= m_count)
+        {
+            Refill();
+        }
+    }
+
+    /**
+     * @brief Returns the number of records left in the current block, starting at current().
+     *
+     * @return The number of records that can be consumed without reading from disk.
+     */
+    size_t available() const
+    {
+        return m_count - m_pos;
+    }
+
+    /**
+     * @brief Skips records of the current block, reading the next block when the current one is consumed.
+     *
+     * @param count The number of records to skip, at most available().
+     */
+    void advance(size_t count)
+    {
+        m_pos += count;
+        if (m_pos >= m_count)
+        {
+            Refill();
+        }
+    }
+
+    /**
+     * @brief Checks if a read from disk has failed.
+     *
+     * @return True if a read error occurred, otherwise false.
+     */
+    bool failed() const
+    {
+        return m_failed;
+    }
+};
+
+/**
+ * @brief Collects records in memory and writes them to disk in large contiguous blocks.
+ *
+ * The writer appends records to the file starting at record index 'start'.
+ * Pending records are written when the block is full, on flush() and on destruction.
+ * Given an I/O thread pool, full blocks are written behind while the next block is filled
+ * in a second buffer. Over a mapped file, records are copied straight into the mapping.
+ * Given codec counters, each block is compressed into a frame, by the I/O thread when there is one,
+ * and the run is placed at the compressed offset of 'start' so that other runs can be written next to it.
+ */
+class RunWriter
+{
+    int m_fd;
+    size_t m_rec_size;
+    size_t m_next; // Index in the file where the block will be written
+    size_t m_block_records;
+    vector<char> m_block;
+    size_t m_count; // Number of records held by the block
+    bool m_failed;
+    ThreadPool *m_io;       // I/O thread pool writing blocks behind, or null to write synchronously
+    vector<char> m_spare;   // Block being written behind
+    future<bool> m_pending; // Result of the write behind
+    char *m_map;            // Start of the mapped file written in place, or null
+    CodecStats *m_codec;    // Counters of the compression, or null to write the records raw
+    vector<char> m_frame;   // Compressed frame being written
+    size_t m_next_byte;     // Byte offset where the next compressed frame will be written
+    PhaseCounters *m_counters; // Counters receiving the time spent writing, or null
+    uint64_t m_wait_ns;        // Time this writer spent writing, when it has counters
+
+    /**
+     * @brief Waits for the block being written behind.
+     */
+    void WaitPending()
+    {
+        if (!m_pending.valid())
+        {
+            return;
+        }
+        if (!m_pending.get())
+        {
+            m_failed = true;
+        }
+        else if (m_codec)
+        {
+            m_next_byte += frame_size(m_frame.data());
+        }
+    }
+
+    /**
+     * @brief Writes the records held by the block, adding the time it takes to the counters.
+     */
+    void WriteBlock()
+    {
+        if (!m_counters)
+        {
+            StoreBlock();
+            return;
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        StoreBlock();
+        AddWait(start);
+    }
+
+    /**
+     * @brief Adds the time since 'start' to the time spent writing.
+     */
+    void AddWait(chrono::steady_clock::time_point start)
+    {
+        uint64_t ns = elapsed_ns(start);
+        m_wait_ns += ns;
+        m_counters->write_ns += ns;
+    }
+
+    /**
+     * @brief Writes the records held by the block, in the background when there is an I/O thread pool.
+     */
+    void StoreBlock()
+    {
+        if (m_count == 0)
+        {
+            return;
+        }
+        if (m_io)
+        {
+            WaitPending();
+            swap(m_block, m_spare);
+            int fd = m_fd;
+            const char *buf = m_spare.data();
+            if (m_codec)
+            {
+                size_t count = m_count;
+                size_t rec_size = m_rec_size;
+                size_t offset = m_next_byte;
+                char *frame = m_frame.data();
+                CodecStats *codec = m_codec;
+                m_pending = submit_io(m_io, [fd, offset, buf, count, rec_size, frame, codec]()
+                                      { return write_frame(fd, offset, buf, count, rec_size, frame, codec); });
+            }
+            else
+            {
+                size_t n = m_count * m_rec_size;
+                size_t offset = m_next * m_rec_size;
+                m_pending = submit_io(m_io, [fd, buf, n, offset]()
+                                      { return write_fully(fd, buf, n, offset); });
+            }
+        }
+        else if (m_codec)
+        {
+            if (write_frame(m_fd, m_next_byte, m_block.data(), m_count, m_rec_size, m_frame.data(), m_codec))
+            {
+                m_next_byte += frame_size(m_frame.data());
+            }
+            else
+            {
+                m_failed = true;
+            }
+        }
+        else if (!write_fully(m_fd, m_block.data(), m_count * m_rec_size, m_next * m_rec_size))
+        {
+            m_failed = true;
+        }
+        m_next += m_count;
+        m_count = 0;
+    }
+
+public:
+    RunWriter(int fd, size_t rec_size, size_t start, size_t block_records, ThreadPool *io = nullptr,
+              CodecStats *codec = nullptr, PhaseCounters *counters = nullptr)
+        : m_fd(fd), m_rec_size(rec_size), m_next(start),
+          m_block_records(codec ? frame_records(rec_size) : max<size_t>(1, block_records)),
+          m_block(m_block_records * rec_size), m_count(0), m_failed(false),
+          m_io(io), m_spare(io ? m_block_records * rec_size : 0), m_map(nullptr),
+          m_codec(codec), m_frame(codec ? FRAME_HEADER_SIZE + m_block_records * rec_size : 0),
+          m_next_byte(compressed_offset(start, rec_size)), m_counters(counters), m_wait_ns(0) {}
+
+    // Constructs a writer storing records straight into a file mapped in memory, starting at record index 'start'.
+    RunWriter(char *map, size_t rec_size, size_t start)
+        : m_fd(-1), m_rec_size(rec_size), m_next(start), m_block_records(1),
+          m_count(0), m_failed(false), m_io(nullptr), m_map(map), m_codec(nullptr), m_next_byte(0), m_counters(nullptr), m_wait_ns(0) {}
+
+    RunWriter(RunWriter &&other) = default;
+
+    ~RunWriter()
+    {
+        flush();
+    }
+
+    /**
+     * @brief Appends a record to the block, writing the block to disk when it is full.
+     *
+     * @param record A pointer to the raw data of the record.
+     */
+    void write(const char *record)
+    {
+        if (m_map)
+        {
+            memcpy(m_map + m_next++ * m_rec_size, record, m_rec_size);
+            return;
+        }
+        copy(record, record + m_rec_size, m_block.begin() + m_count * m_rec_size);
+        if (++m_count == m_block_records)
+        {
+            WriteBlock();
+        }
+    }
+
+    /**
+     * @brief Appends records stored back to back, filling and writing whole blocks at a time.
+     *
+     * @param records A pointer to the raw data of the first record.
+     * @param count The number of records to append.
+     */
+    void write(const char *records, size_t count)
+    {
+        if (m_map)
+        {
+            memcpy(m_map + m_next * m_rec_size, records, count * m_rec_size);
+            m_next += count;
+            return;
+        }
+        while (count > 0)
+        {
+            size_t n = min(count, m_block_records - m_count);
+            copy(records, records + n * m_rec_size, m_block.begin() + m_count * m_rec_size);
+            records += n * m_rec_size;
+            count -= n;
+            m_count += n;
+            if (m_count == m_block_records)
+            {
+                WriteBlock();
+            }
+        }
+    }
+
+    /**
+     * @brief Starts a new run at record index 'start' of the file, after writing the records of the previous one.
+     *
+     * A run that follows the previous one without a gap only needs this when the runs are compressed,
+     * since their frames must start at the compressed offset of their first record.
+     *
+     * @param start The index of the first record of the new run.
+     */
+    void StartRun(size_t start)
+    {
+        if (!m_codec && start == m_next + m_count)
+        {
+            return;
+        }
+        flush();
+        m_next = start;
+        m_next_byte = compressed_offset(start, m_rec_size);
+    }
+
+    /**
+     * @brief Writes all pending records to disk and waits until they are written.
+     */
+    void flush()
+    {
+        WriteBlock();
+        if (!m_counters || !m_pending.valid())
+        {
+            WaitPending();
+            return;
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        WaitPending();
+        AddWait(start);
+    }
+
+    /**
+     * @brief Returns the time this writer spent writing or waiting for its writes, when it was given counters.
+     *
+     * @return The time in nanoseconds.
+     */
+    uint64_t wait_ns() const
+    {
+        return m_wait_ns;
+    }
+
+    /**
+     * @brief Checks if a write to disk has failed.
+     *
+     * @return True if a write error occurred, otherwise false.
+     */
+    bool failed() const
+    {
+        return m_failed;
+    }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef RUNMERGER_H
+#define RUNMERGER_H
+
+#include <vector>
+#include <runIO.h>
+#include <record.h>
+#include <loserTree.h>
+#include <offsetValueCode.h>
+#include <keyPrefix.h>
+
+using namespace std;
+
+/**
+ * @brief Orders run readers by the offset-value codes of their current records for the LoserTree merge.
+ *
+ * The codes of two readers meeting in a match are relative to the same base record, so differing codes decide
+ * the match alone. Equal codes fall back to the key bytes after the coded one, and the code of the loser is then
+ * rebuilt against the winner, as the tree of losers expects. Keys that fit in a normalized prefix are coded by
+ * the prefix itself, which needs no rebuilding. Exhausted readers come after all others, and readers with equal keys
+ * are ordered by their index, so the merge is stable.
+ */
+struct ReaderPrecedes
+{
+    const vector<RunReader> *readers;
+    vector<uint64_t> *codes;
+    long key_size;
+    int sorting_order;
+    bool prefix_codes; // Whether the codes are the normalized keys instead of offset-value codes
+
+    bool operator()(size_t a, size_t b) const
+    {
+        uint64_t &code_a = (*codes)[a];
+        uint64_t &code_b = (*codes)[b];
+        if (code_a != code_b)
+        {
+            return code_a < code_b;
+        }
+        if (prefix_codes || code_a == OVC_EXHAUSTED || code_a == 0)
+        {
+            // Equal keys, or exhausted readers, whose code may equal the code of a key
+            bool empty_a = (*readers)[a].empty();
+            bool empty_b = (*readers)[b].empty();
+            return empty_a != empty_b ? empty_b : a < b;
+        }
+
+        const char *ra = (*readers)[a].current();
+        const char *rb = (*readers)[b].current();
+        long offset = key_mismatch(ra, rb, ovc_offset(code_a, key_size) + 1, key_size);
+        bool a_first = a < b;
+        if (offset < key_size)
+        {
+            bool less = static_cast<unsigned char>(ra[offset]) < static_cast<unsigned char>(rb[offset]);
+            a_first = sorting_order == 1 ? less : !less;
+        }
+        if (a_first)
+        {
+            code_b = ovc_make(rb, offset, key_size, sorting_order);
+        }
+        else
+        {
+            code_a = ovc_make(ra, offset, key_size, sorting_order);
+        }
+        return a_first;
+    }
+};
+
+/**
+ * @brief Merges sorted runs into one sorted stream of records.
+ *
+ * Each run is streamed through its own RunReader, and a LoserTree continuously picks the reader holding
+ * the smallest or largest record (depending on the sorting order). Records never leave the readers' blocks,
+ * so current() points into the block of the winning reader until the next advance().
+ * Records with equal keys come out in the order of their runs.
+ *
+ * Every reader carries the offset-value code of its current record against the last record output (see
+ * offsetValueCode.h). The code of a reader's next record is taken once against the record it follows in its run,
+ * so keys sharing long prefixes are scanned once per record rather than once per comparison.
+ * Keys no longer than a normalized prefix are instead coded by their prefix (see key_prefix), complemented
+ * in descending order, which orders them with one compare and costs less to build.
+ */
+class RunMerger
+{
+    vector<RunReader> m_readers;
+    vector<uint64_t> m_codes; // Offset-value code of the current record of each reader
+    vector<char> m_last_key;  // Key of the record output last, when it left the block of its reader
+    int m_sorting_order;
+    bool m_prefix_codes;
+    LoserTree<ReaderPrecedes> m_tree;
+
+    RunMerger(const RunMerger &);
+    RunMerger &operator=(const RunMerger &);
+
+    /**
+     * @brief Codes the first record of every reader, against a base that comes before all keys.
+     */
+    static vector<uint64_t> InitialCodes(const vector<RunReader> &readers, int sorting_order)
+    {
+        vector<uint64_t> codes(readers.size(), OVC_EXHAUSTED);
+        for (size_t i = 0; i < readers.size(); i++)
+        {
+            if (readers[i].empty())
+            {
+                continue;
+            }
+            if (KEY_SIZE <= KEY_PREFIX_SIZE)
+            {
+                uint64_t prefix = key_prefix(readers[i].current());
+                codes[i] = sorting_order == 1 ? prefix : ~prefix;
+            }
+            else
+            {
+                codes[i] = ovc_make(readers[i].current(), 0, KEY_SIZE, sorting_order);
+            }
+        }
+        return codes;
+    }
+
+public:
+    RunMerger(vector<RunReader> &&readers, int sorting_order)
+        : m_readers(move(readers)), m_codes(InitialCodes(m_readers, sorting_order)), m_last_key(KEY_SIZE),
+          m_sorting_order(sorting_order), m_prefix_codes(KEY_SIZE <= KEY_PREFIX_SIZE),
+          m_tree(m_readers.size(), ReaderPrecedes{&m_readers, &m_codes, KEY_SIZE, sorting_order, m_prefix_codes}) {}
+
+    /**
+     * @brief Checks if all records of all runs have been consumed.
+     *
+     * @return True if there are no more records, otherwise false.
+     */
+    bool empty() const
+    {
+        return m_readers.empty() || m_readers[m_tree.winner()].empty();
+    }
+
+    /**
+     * @brief Returns a pointer to the next record of the merge.
+     *
+     * @return A const pointer to the raw data of the record.
+     */
+    const char *current() const
+    {
+        return m_readers[m_tree.winner()].current();
+    }
+
+    /**
+     * @brief Consumes the current record and finds the next one.
+     */
+    void advance()
+    {
+        size_t winner = m_tree.winner();
+        RunReader &reader = m_readers[winner];
+        if (m_prefix_codes)
+        {
+            reader.advance();
+            uint64_t prefix = reader.empty() ? 0 : key_prefix(reader.current());
+            m_codes[winner] = reader.empty() ? OVC_EXHAUSTED : m_sorting_order == 1 ? prefix : ~prefix;
+            m_tree.replay();
+            return;
+        }
+
+        // The record just output is the base of the next one, kept aside if the reader refills its block
+        const char *previous = reader.current();
+        if (reader.available() <= 1)
+        {
+            memcpy(m_last_key.data(), previous, m_last_key.size());
+            previous = m_last_key.data();
+        }
+        reader.advance();
+        if (reader.empty())
+        {
+            m_codes[winner] = OVC_EXHAUSTED;
+        }
+        else
+        {
+            long key_size = static_cast<long>(m_last_key.size());
+            long offset = key_mismatch(reader.current(), previous, 0, key_size);
+            m_codes[winner] = ovc_make(reader.current(), offset, key_size, m_sorting_order);
+        }
+        m_tree.replay();
+    }
+
+    /**
+     * @brief Returns the number of comparisons of the merge so far.
+     */
+    uint64_t comparisons() const
+    {
+        return m_tree.comparisons();
+    }
+
+    /**
+     * @brief Checks if a read from disk has failed.
+     *
+     * @return True if a read error occurred, otherwise false.
+     */
+    bool failed() const
+    {
+        for (size_t i = 0; i < m_readers.size(); i++)
+        {
+            if (m_readers[i].failed())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif
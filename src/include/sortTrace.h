@@ -0,0 +1,149 @@
+#ifndef SORTTRACE_H
+#define SORTTRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <utility>
+#include <unistd.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+/**
+ * @brief Time and work counters of one phase of a sort, shared by all its threads.
+ *
+ * Readers, writers and sorters only update the counters they are given, so a sort that is not traced pays
+ * for nothing but a null check per block. Times are summed over the threads of the phase.
+ */
+struct PhaseCounters
+{
+    atomic<uint64_t> read_ns;     // Time spent reading blocks, or waiting for prefetched ones
+    atomic<uint64_t> write_ns;    // Time spent writing blocks, or waiting for the ones written behind
+    atomic<uint64_t> sort_ns;     // Time spent sorting in memory
+    atomic<uint64_t> comparisons; // Record comparisons of the merges
+
+    PhaseCounters() : read_ns(0), write_ns(0), sort_ns(0), comparisons(0) {}
+
+    /**
+     * @brief Clears the counters before a new phase.
+     */
+    void reset()
+    {
+        read_ns = 0;
+        write_ns = 0;
+        sort_ns = 0;
+        comparisons = 0;
+    }
+};
+
+/**
+ * @brief Returns the peak resident memory of the process so far in KB.
+ */
+inline long peak_rss_kb()
+{
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+}
+
+/**
+ * @brief One phase of a sort, with the numbers describing it.
+ */
+struct TraceEvent
+{
+    string name;
+    double start;    // Seconds since the trace started
+    double duration; // Seconds
+    vector<pair<string, double>> args;
+};
+
+/**
+ * @brief Collects the phases of a sort and writes them as JSON lines or as a Chrome trace.
+ *
+ * JSON lines hold one object per phase with its name, start and duration in seconds and its numbers.
+ * A Chrome trace ("chrome" format) holds the phases as complete events, which chrome://tracing and Perfetto show
+ * on a timeline with their numbers as arguments.
+ */
+class SortTrace
+{
+    chrono::steady_clock::time_point m_origin;
+    vector<TraceEvent> m_events;
+
+public:
+    SortTrace() : m_origin(chrono::steady_clock::now()) {}
+
+    /**
+     * @brief Records a phase that started at 'start' and ends now.
+     *
+     * @param name The name of the phase.
+     * @param start When the phase started.
+     * @param args The numbers describing the phase.
+     */
+    void Add(const string &name, chrono::steady_clock::time_point start, const vector<pair<string, double>> &args)
+    {
+        TraceEvent event;
+        event.name = name;
+        event.start = chrono::duration<double>(start - m_origin).count();
+        event.duration = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        event.args = args;
+        m_events.push_back(event);
+    }
+
+    /**
+     * @brief Checks if no phase was recorded since the last write.
+     */
+    bool empty() const
+    {
+        return m_events.empty();
+    }
+
+    /**
+     * @brief Writes the recorded phases to a file and forgets them.
+     *
+     * @param file_name The file to create.
+     * @param format "jsonl" for JSON lines, or "chrome" for a Chrome trace.
+     * @return True if the file was written, otherwise false.
+     */
+    bool Write(const string &file_name, const string &format)
+    {
+        FILE *file = fopen(file_name.c_str(), "w");
+        if (!file)
+        {
+            return false;
+        }
+        bool chrome = format == "chrome";
+        if (chrome)
+        {
+            fprintf(file, "{\"traceEvents\":[\n");
+        }
+        for (size_t i = 0; i < m_events.size(); i++)
+        {
+            const TraceEvent &event = m_events[i];
+            if (chrome)
+            {
+                fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"extsort\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":0,\"args\":{",
+                        i > 0 ? ",\n" : "", event.name.c_str(), event.start * 1e6, event.duration * 1e6, static_cast<int>(getpid()));
+            }
+            else
+            {
+                fprintf(file, "{\"phase\":\"%s\",\"start_s\":%.6f,\"seconds\":%.6f", event.name.c_str(), event.start, event.duration);
+            }
+            for (size_t k = 0; k < event.args.size(); k++)
+            {
+                fprintf(file, "%s\"%s\":%.15g", chrome && k == 0 ? "" : ",", event.args[k].first.c_str(), event.args[k].second);
+            }
+            fprintf(file, chrome ? "}}" : "}\n");
+        }
+        if (chrome)
+        {
+            fprintf(file, "\n]}\n");
+        }
+        m_events.clear();
+        return fclose(file) == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <recordShape.h>
+
+using namespace std;
+
+/**
+ * @brief A fixed set of worker threads running submitted tasks.
+ *
+ * Tasks are run in the order they are submitted; wait() blocks until every submitted task has finished.
+ * Each task runs with the RecordShape of the thread that submitted it.
+ */
+class ThreadPool
+{
+    vector<thread> m_workers;
+    queue<function<void()>> m_tasks;
+    mutex m_mutex;
+    condition_variable m_task_ready;
+    condition_variable m_all_done;
+    size_t m_pending; // Number of tasks queued or running
+    bool m_stopping;
+
+    /**
+     * @brief Runs queued tasks until the pool is destroyed.
+     */
+    void Work()
+    {
+        while (true)
+        {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(m_mutex);
+                m_task_ready.wait(lock, [this]()
+                                  { return m_stopping || !m_tasks.empty(); });
+                if (m_tasks.empty())
+                {
+                    return;
+                }
+                task = move(m_tasks.front());
+                m_tasks.pop();
+            }
+
+            task();
+
+            unique_lock<mutex> lock(m_mutex);
+            if (--m_pending == 0)
+            {
+                m_all_done.notify_all();
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t num_of_threads) : m_pending(0), m_stopping(false)
+    {
+        for (size_t i = 0; i < max<size_t>(1, num_of_threads); i++)
+        {
+            m_workers.push_back(thread(&ThreadPool::Work, this));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_task_ready.notify_all();
+        for (size_t i = 0; i < m_workers.size(); i++)
+        {
+            m_workers[i].join();
+        }
+    }
+
+    /**
+     * @brief Queues a task to be run by one of the workers.
+     *
+     * @param task The task to run.
+     */
+    void submit(function<void()> task)
+    {
+        RecordShape shape = RecordShape::Current();
+        {
+            unique_lock<mutex> lock(m_mutex);
+            m_tasks.push([shape, task]()
+                         {
+                             shape.Install();
+                             task(); });
+            m_pending++;
+        }
+        m_task_ready.notify_one();
+    }
+
+    /**
+     * @brief Blocks until all submitted tasks have finished.
+     */
+    void wait()
+    {
+        unique_lock<mutex> lock(m_mutex);
+        m_all_done.wait(lock, [this]()
+                        { return m_pending == 0; });
+    }
+
+    /**
+     * @brief Gets the number of worker threads.
+     *
+     * @return The number of worker threads in the pool.
+     */
+    size_t size() const
+    {
+        return m_workers.size();
+    }
+};
+
+#endif